@@ -1,22 +1,109 @@
 #include "ruby.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
 #include <search.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ruby/thread.h"
+#include "ruby/vm.h"
 
 // TODO: fix all int/uint conversion issues with counters
-// TODO: optimize logging for log levels
-// TODO: have function to enable/disable logging at runtime
 // TODO: general cleanup
 //
 
 #define SLOT_WEIGHT_INITIAL_VAL -1.0
+#define SLOT_WEIGHT_INELIGIBLE -FLT_MAX
+
+// the transposition cache falls back to an exact subset table when the
+// whole 2^num_people table fits in its memory budget
+//
+#define CACHE_DP_MAX_PEOPLE 24
+#define CACHE_PROBES 4
+#define CACHE_BOUND_SLACK 1e-4f
+
+// schedules up to this size run on the specialized small kernels
+// (build with -DBRANCHY_NO_SMALL_KERNELS to always use the tree)
+//
+#define SMALL_MAX_PEOPLE 64
+#define SMALL_MAX_SLOTS 16
+
+// search modes.  the heuristic modes trade optimality for a predictable
+// running time on schedules too large for the exact search.
+//
+#define SEARCH_EXACT 0
+#define SEARCH_BEAM 1        // keep the best 'limit' branches per depth
+#define SEARCH_DISCREPANCY 2 // stray at most 'limit' ranks from the best branch
+
+// schedules without constraints are ranked as assignment problems
+// (build with -DBRANCHY_NO_MURTY to always use the tree)
+//
+#define MURTY_INFINITY HUGE_VAL
+
+// the search state lives in thread-local storage so the batch entry
+// point can run independent schedules on several threads at once
+//
+#define BRANCHY_TLS __thread
+
+// trace levels, set at runtime with schedule_set_trace.  each level
+// records everything the levels below it do.
+// (build with -DBRANCHY_NO_TRACE to compile every trace point out)
+//
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_SEARCH 1 // solves, presolve decisions and incumbents
+#define TRACE_LEVEL_NODES 2  // every branch created, selected and pruned
+#define TRACE_LEVEL_ALL 3    // comparisons, constraint checks and frees
+#define TRACE_DEFAULT_EVENTS 65536
+
+// trace event types, and the reasons attached to them
+//
+#define TRACE_SOLVE 0
+#define TRACE_CANDIDATES 1
+#define TRACE_PRESOLVE 2
+#define TRACE_CREATE 3
+#define TRACE_SELECT 4
+#define TRACE_EXPAND 5
+#define TRACE_PRUNE 6
+#define TRACE_INCUMBENT 7
+#define TRACE_COMPARE 8
+#define TRACE_CONSTRAINT 9
+#define TRACE_FREE 10
+
+#define TRACE_REASON_NONE 0
+#define TRACE_REASON_BEGIN 1
+#define TRACE_REASON_END 2
+#define TRACE_REASON_BOUND 3     // bound below the last incumbent
+#define TRACE_REASON_CACHE 4     // bound from the transposition cache
+#define TRACE_REASON_LEAF 5      // complete, handed to the incumbents
+#define TRACE_REASON_BEAM 6      // pushed out of a full beam
+#define TRACE_REASON_PASS 7
+#define TRACE_REASON_FAIL 8
+#define TRACE_REASON_DOMINATED 9
+#define TRACE_REASON_DUPLICATE 10
+#define TRACE_REASON_FORCED 11
+#define TRACE_REASON_REDUCED 12
+
+#ifndef BRANCHY_NO_TRACE
+#define TRACE(lvl, type, reason, depth, person_id, weight, value)           \
+  do {                                                                     \
+    if (trace.level >= (lvl)) {                                            \
+      trace_record((type), (reason), (depth), (person_id), (weight), (value)); \
+    }                                                                      \
+  } while (0)
+#else
+#define TRACE(lvl, type, reason, depth, person_id, weight, value) \
+  do { } while (0)
+#endif
 
 // bundle exec rake install
 // irb -rubygems
 // require 'branchy'
 // include branchy
 //
-static int debug = 0;
 
 typedef struct _node_t node_t;
 
@@ -32,7 +119,6 @@ struct _solution_t {
   float total_weight;      // solution weight.
   int total_depth;         // depth into the solution (0 to num_slots).
   int total_children;      // # of children in chilren array.
-  int *used_person_id_map; // bitmap of locked person_ids in the node_list.
   node_t *node_list;       // array of solution nodes for this solution.
   solution_t *parent;      // each solution branch will have 0 or 1 parent.
   solution_t *children;    // each solution branch may have many children.
@@ -45,39 +131,339 @@ struct _context_t {
   int *values;     // integer-based context set
 };
 
+typedef struct _sparse_row_t sparse_row_t;
+
+struct _sparse_row_t {
+  uint num_values; // # of slots the entity is eligible for
+  int *slots;      // eligible slot ids, in ascending order
+  float *weights;  // weight for each eligible slot
+};
+
 typedef struct _schedule_t schedule_t;
 
 struct _schedule_t {
   int num_people;      // # of entities being considered
   int num_slots;       // # of scheduling slots to be filled
   int num_constraints; // # of scheduling constraints
-  float **weights;     // schedule weight grid
+  float **weights;     // schedule weight grid (NULL rows are sparse)
+  sparse_row_t **sparse;   // sparse weights for each entity (or NULL)
   context_t **attribs; // attribute set for each entity
   context_t **constraints; // bounding constraints
+
+  // per-slot candidate lists (CSR layout) holding only the entities
+  // that can be picked for a slot, rebuilt when the weights change
+  //
+  int candidates_valid;     // whether the lists match the weights
+  int *slot_offsets;        // num_slots+1 offsets into the lists
+  int *candidate_ids;       // eligible person_ids, grouped by slot
+  float *candidate_weights; // weight of each candidate
+
+  int presolve;             // whether to reduce the problem before branching
+  long cache_bytes;         // transposition cache budget (0 disables it)
+  int search_mode;          // SEARCH_EXACT, SEARCH_BEAM or SEARCH_DISCREPANCY
+  int search_limit;         // beam width or discrepancy budget
+};
+
+typedef struct _result_t result_t;
+
+struct _result_t {
+  int count;            // # of solutions in the result
+  int num_slots;        // # of slots in each solution
+  node_t *nodes;        // count * num_slots solution nodes
+  float *total_weights; // weight of each solution
+};
+
+typedef struct _presolve_t presolve_t;
+
+struct _presolve_t {
+  schedule_t *reduced; // reduced schedule, NULL if nothing was removed
+  int *person_map;     // reduced person_id -> original person_id
+  int *slot_map;       // reduced slot_id -> original slot_id
+  node_t *fixed;       // forced node for each original slot (-1 if none)
+  float fixed_weight;  // total weight of the forced nodes
+};
+
+typedef struct _solve_stats_t solve_stats_t;
+
+struct _solve_stats_t {
+  int expanded;    // # of branches expanded by the search
+  int dominated;   // # of entities dropped as dominated in every slot
+  int duplicates;  // # of entities dropped as interchangeable copies
+  int classes;     // # of equivalence classes with more than one entity
+  int fixed_slots; // # of slots with a forced assignment
+  int cache_lookups;   // # of transposition cache probes
+  int cache_hits;      // # of probes that found a bound
+  int cache_prunes;    // # of branches pruned by a cached bound
+  int cache_stores;    // # of bounds written to the cache
+  int cache_evictions; // # of entries overwritten by newer ones
+  int dp_states;       // # of subset table entries computed
+  int assignments;     // # of assignment problems solved by the ranking
+  float root_bound;    // upper bound on the weight of any solution
+  float gap;           // root_bound - best weight found (NAN if none)
+};
+
+typedef struct _small_node_t small_node_t;
+
+struct _small_node_t {
+  int active;          // whether or this branch is being considered.
+  int total_children;  // # of children in the depth's child array.
+  float total_weight;  // solution weight.
+  uint64_t used;       // locked person_ids in the node_list.
+  node_t node_list[SMALL_MAX_SLOTS];
+};
+
+typedef struct _small_arena_t small_arena_t;
+
+struct _small_arena_t {
+  int num_people;
+  int num_slots;
+
+  // per-slot candidates ordered by weight (highest first, then by
+  // person_id), so the first unused one is the best in slot
+  //
+  int num_candidates[SMALL_MAX_SLOTS];
+  uint8_t candidate_ids[SMALL_MAX_SLOTS][SMALL_MAX_PEOPLE];
+  float candidate_weights[SMALL_MAX_SLOTS][SMALL_MAX_PEOPLE];
+
+  // the same candidates in person_id order, which is the order the tree
+  // creates its children in, with the weight each one locks in
+  //
+  uint8_t lock_ids[SMALL_MAX_SLOTS][SMALL_MAX_PEOPLE];
+  float lock_weights[SMALL_MAX_SLOTS][SMALL_MAX_PEOPLE];
+
+  // the search only ever looks at the children of the branch being
+  // expanded, so one child array per depth is enough
+  //
+  small_node_t root;
+  small_node_t children[SMALL_MAX_SLOTS][SMALL_MAX_PEOPLE];
+  small_node_t *incumbents;
+  int incumbents_size; // # of incumbents allocated
+};
+
+typedef struct _trace_event_t trace_event_t;
+
+struct _trace_event_t {
+  uint64_t time;     // ns since the solve started
+  float weight;      // branch or solution weight
+  int32_t person_id; // person the event is about (-1 for none)
+  int32_t value;     // event specific: index, count or other person
+  uint8_t type;      // TRACE_*
+  uint8_t reason;    // TRACE_REASON_*
+  uint16_t depth;    // depth of the branch, or slot id
+};
+
+typedef struct _trace_t trace_t;
+
+struct _trace_t {
+  int level;              // TRACE_LEVEL_* for this solve
+  uint32_t capacity;      // # of events the ring holds
+  uint64_t count;         // # of events recorded, including overwritten ones
+  uint64_t start;         // clock at the start of the solve
+  trace_event_t *events;  // ring buffer, oldest at count % capacity once full
+};
+
+typedef struct _assignment_t assignment_t;
+
+struct _assignment_t {
+  int parent;       // solved assignment this one was partitioned from
+  int forbid_row;   // row whose parent column is excluded (-1 for none)
+  int forbid_col;   // the excluded column
+  int forbid_cand;  // candidate of the excluded edge
+  float weight;     // total weight of the rows
+  int *col_for_row; // matching, one column per row
+  double *u;        // row duals
+  double *v;        // duals of the matched columns, one per row
+  char *forced;     // rows held to their column by the partition
+};
+
+typedef struct _murty_entry_t murty_entry_t;
+
+struct _murty_entry_t {
+  float weight; // weight of the partition's best assignment
+  int parent;   // solved assignment that was partitioned
+  int index;    // which partition of the parent
+  int seq;      // insertion order, to break ties deterministically
+};
+
+typedef struct _murty_t murty_t;
+
+struct _murty_t {
+  int n;                 // # of columns (people)
+  int k;                 // # of rows (slots)
+  double *cost;          // costs, one per slot candidate
+  char *forbid;          // excluded candidates of the current partition
+  char *locked;          // columns held by forced rows
+  int *row_for_col;      // matching being solved, one row per column
+  double *v;             // column duals being solved, zero when unmatched
+  double *dist;          // scratch for the shortest path search
+  int *path;
+  int *remaining;
+  char *row_seen;
+  char *col_seen;
+  assignment_t scratch;  // partition being evaluated
+  assignment_t *solved;  // assignments handed out so far
+  int num_solved;
+  murty_entry_t *heap;   // max-heap of partitions not yet handed out
+  int heap_size;
+  int heap_capacity;
+  int seq;
+};
+
+typedef struct _cache_entry_t cache_entry_t;
+
+struct _cache_entry_t {
+  uint64_t key[2]; // fingerprint of the locked person set
+  int depth;       // # of locked slots (0 marks an empty entry)
+  float bound;     // upper bound on the weight of the remaining slots
+};
+
+typedef struct _cache_t cache_t;
+
+struct _cache_t {
+  cache_entry_t *entries; // hash table keyed on (depth, locked set)
+  uint64_t mask;          // # of entries - 1 (a power of two)
+  float *dp;              // best completion per locked set bitmask
+  int **dp_maps;          // per-depth person maps for the subset table
+  int *dp_ids;            // best-in-slot fill for the subset table
+  float subtree_best;     // best leaf weight in the branch being expanded
+};
+
+typedef struct _batch_t batch_t;
+
+struct _batch_t {
+  int count;             // # of instances
+  schedule_t **schedules;
+  int *num_solutions;    // # of solutions requested per instance
+  result_t *results;
+  char *completed;       // whether each instance was solved to the end
+  int next;              // next instance to hand out to a thread
+  volatile int cancelled; // set when Ruby interrupts the batch
+};
+
+typedef struct _pool_t pool_t;
+
+struct _pool_t {
+  pthread_mutex_t lock;    // guards everything below
+  pthread_mutex_t running; // held by the batch using the pool
+  pthread_cond_t work;     // a new batch was posted
+  pthread_cond_t done;     // a thread finished its part of the batch
+  int started;             // whether the threads were started
+  int stopping;            // set when the VM exits
+  int atfork;              // whether the fork handler is registered
+  int size;                // # of threads in the pool
+  int busy;                // # of threads still working on the batch
+  uint64_t generation;     // bumped for every posted batch
+  batch_t *batch;          // batch being solved
 };
 
-static schedule_t *sched = NULL;
-static int num_expanded_solutions = 0;
-static int num_requested_solutions = 0;
-static solution_t *incumbent_set = NULL;
-static int incumbent_count = 0;
+// 'schedule' is the one built through the Ruby methods, 'sched' is the
+// one the search is running on in the current thread
+//
+static schedule_t *schedule = NULL;
+static solve_stats_t last_stats;
+static trace_t last_trace;
+static int trace_level = TRACE_LEVEL_OFF;
+static uint32_t trace_capacity = TRACE_DEFAULT_EVENTS;
+static pool_t pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
 
-int fact(int n);
+static BRANCHY_TLS schedule_t *sched = NULL;
+static BRANCHY_TLS int num_expanded_solutions = 0;
+static BRANCHY_TLS int num_requested_solutions = 0;
+static BRANCHY_TLS solution_t *incumbent_set = NULL;
+static BRANCHY_TLS int incumbent_count = 0;
+static BRANCHY_TLS solve_stats_t stats;
+static BRANCHY_TLS context_t **presolve_keys = NULL;
+static BRANCHY_TLS cache_t cache;
+static BRANCHY_TLS small_arena_t *small_scratch = NULL;
+static BRANCHY_TLS trace_t trace;
+static BRANCHY_TLS node_t **owned_lists = NULL;
+static BRANCHY_TLS int owned_count = 0;
+static BRANCHY_TLS volatile int *cancel = NULL;
+
+uint64_t trace_now(void);
+void trace_begin(void);
+void trace_record(int type, int reason, int depth, int person_id,
+                  float weight, int value);
 int compare(const int *x, const int *y);
 int compare_contexts(const context_t *x, const context_t *y);
 void print_solution(const node_t *nodes, int number_of_slots);
 int solution_is_feasible(const solution_t *s);
 int solution_is_active(const solution_t *s);
+int constraint_match(int constraint_id, const int *node_list, int *matched,
+                     char *visited);
 int solution_validates_constraints(const solution_t *s);
+float schedule_weight(int person_id, int slot_id);
+int schedule_build_candidates(void);
 float max_cost_for_slot(int slot_id, int* constraint_map, int *person_id);
 float incumbent_get_last_weight(void);
 void incumbent_update_and_prune(solution_t *s);
 int create_root(solution_t **root);
 int create_branch(solution_t *root, int depth);
 int select_branch(solution_t *branch, solution_t **new_root);
-int prune_branch(solution_t *branch);
+int prune_branch(solution_t *branch, int reason);
 int expand_branch(solution_t *root, int depth);
+int search_cancelled(void);
 int free_branch(solution_t *root);
+float root_bound(void);
+void heuristic_offer(solution_t *s);
+node_t *owned_list_new(void);
+void owned_lists_free(void);
+int compare_branches(const solution_t **x, const solution_t **y);
+int beam_search(solution_t *root);
+int discrepancy_expand(solution_t *root, int depth, int budget);
+context_t *context_copy(const context_t *c);
+schedule_t *schedule_new(int num_slots);
+void schedule_destroy(schedule_t *s);
+int compare_weights_desc(const float *x, const float *y);
+int compare_people(const int *x, const int *y);
+int person_meets_constraints(int person_id);
+int presolve_run(presolve_t *pre, int num_solutions);
+void presolve_free(presolve_t *pre);
+int incumbent_export(result_t *r, const presolve_t *pre);
+void result_free(result_t *r);
+float branch_weight(int person_id, int depth);
+uint64_t mix_person(uint64_t x);
+int cache_init(long max_bytes);
+void cache_free(void);
+float cache_completion(uint64_t mask, int depth);
+float cache_lookup(const solution_t *s, int *found);
+void cache_store(const solution_t *s, float best);
+int cache_prunes_branch(const solution_t *s);
+int small_kernel_fits(void);
+int compare_candidates(const int *x, const int *y);
+small_arena_t *small_arena_get(void);
+float small_fill(const small_arena_t *a, small_node_t *s, int from);
+int small_select_branch(small_arena_t *a, small_node_t *root, int depth,
+                        small_node_t **new_root);
+void small_incumbent_update_and_prune(small_arena_t *a, small_node_t *s);
+int small_search(small_arena_t *a);
+int murty_fits(void);
+int assignment_alloc(assignment_t *a, int k);
+void assignment_free(assignment_t *a);
+void assignment_copy(assignment_t *dst, const assignment_t *src, int k);
+int murty_init(murty_t *m);
+void murty_free(murty_t *m);
+int murty_candidate(int row, int col);
+float murty_weight(const murty_t *m, const assignment_t *a);
+void murty_load(murty_t *m, const assignment_t *a);
+void murty_unload(murty_t *m, const assignment_t *a);
+int murty_augment(murty_t *m, assignment_t *a, int row, int target);
+int murty_partition(murty_t *m, int parent, int index, assignment_t *a);
+int murty_push(murty_t *m, float weight, int parent, int index);
+int murty_pop(murty_t *m, murty_entry_t *e);
+void murty_emit(murty_t *m, const assignment_t *a);
+int murty_search(void);
+int schedule_solve(schedule_t *s, int num_solutions, result_t *r);
+void *batch_worker(void *arg);
+void *pool_thread(void *arg);
+void pool_stop(ruby_vm_t *vm);
+void pool_atfork_child(void);
+int pool_start(void);
+void *batch_run(void *arg);
+void batch_interrupt(void *arg);
 
 #define safe_free(var)  \
   do {                  \
@@ -87,13 +473,54 @@ int free_branch(solution_t *root);
     }                   \
   } while(0)
 
-int
-fact(int n)
+uint64_t
+trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void
+trace_begin(void)
+{
+  // every solve starts with an empty ring at the current level; the
+  // ring itself is kept for the next solve on this thread
+  //
+#ifndef BRANCHY_NO_TRACE
+  trace.level = trace_level;
+#else
+  trace.level = TRACE_LEVEL_OFF;
+#endif
+  trace.count = 0;
+  trace.start = trace_now();
+
+  if (trace.level > TRACE_LEVEL_OFF && trace.capacity != trace_capacity) {
+    safe_free(trace.events);
+    trace.capacity = trace_capacity;
+  }
+  if (trace.level > TRACE_LEVEL_OFF && !trace.events) {
+    trace.events = calloc(trace.capacity, sizeof(trace_event_t));
+    if (!trace.events) {
+      trace.level = TRACE_LEVEL_OFF;
+    }
+  }
+}
+
+void
+trace_record(int type, int reason, int depth, int person_id,
+             float weight, int value)
 {
-  int result = 1;
-  for(int i = 1; i <= n ; i++)
-    result = result * i;
-  return result;
+  trace_event_t *e = &trace.events[trace.count++ % trace.capacity];
+
+  e->time = trace_now() - trace.start;
+  e->weight = weight;
+  e->person_id = person_id;
+  e->value = value;
+  e->type = (uint8_t)type;
+  e->reason = (uint8_t)reason;
+  e->depth = (uint16_t)depth;
 }
 
 int
@@ -160,6 +587,12 @@ solution_is_feasible(const solution_t *s)
   for (int i = 0; i < sched->num_slots; i++) {
     p = s->node_list[i].person_id;
 
+    // slots with no eligible entity left are never filled
+    //
+    if (p < 0) {
+      continue;
+    }
+
     if (map[p] == 0) {
       map[p] = 1;
       count++;
@@ -187,77 +620,195 @@ solution_is_active(const solution_t *s)
   return ret_val;
 }
 
+int
+constraint_match(int constraint_id, const int *node_list, int *matched,
+                 char *visited)
+{
+  // give the constraint set a slot whose entity covers it, moving the
+  // set already holding that slot to another one when it can
+  //
+  context_t *constraint_set = sched->constraints[constraint_id];
+
+  for (int slot_id = 0; slot_id < sched->num_slots; slot_id++) {
+    int entity_id = node_list[slot_id];
+
+    if (entity_id == -1 || visited[slot_id] ||
+        !compare_contexts(constraint_set, sched->attribs[entity_id])) {
+      continue;
+    }
+    visited[slot_id] = 1;
+
+    if (matched[slot_id] == -1 ||
+        constraint_match(matched[slot_id], node_list, matched, visited)) {
+      matched[slot_id] = constraint_id;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 int
 solution_validates_constraints(const solution_t *s)
 {
   int ret_val = 1;
-
   int *node_list = calloc(sched->num_slots, sizeof(int));
+  int *matched = calloc(sched->num_slots, sizeof(int));
+  char *visited = calloc(sched->num_slots, sizeof(char));
+
   for (int i = 0; i < sched->num_slots; i++) {
     node_list[i] = s->node_list[i].person_id;
+    matched[i] = -1;
   }
 
   // walk through the constraint sets
   //
   for (int i = 0; i < sched->num_constraints; i++) {
 
-    // check if each constraint set is included in the attribs for
-    // one unique entity in the solution.  'unique' meaning that the
-    // entity has not already been mapped to a constraint set.
+    // each constraint set has to be included in the attribs of one
+    // unique entity in the solution.  sets can overlap, so this is a
+    // matching of sets to slots: an earlier set gives up its slot when
+    // it can move to another one.
     //
-    context_t *constraint_set = sched->constraints[i];
-
-    int found = 0;
-    int slot_id = 0;
-
-    while(slot_id < sched->num_slots && !found) {
-
-      int entity_id = node_list[slot_id++];
-      if (entity_id == -1) {
-        continue;
-      }
-
-      context_t *attributes_set = sched->attribs[entity_id];
+    memset(visited, 0, sched->num_slots * sizeof(char));
 
-      // each constraint set may have multiple entries, so
-      // check for each one
-      //
-      found = compare_contexts(constraint_set, attributes_set);
-    }
+    if (constraint_match(i, node_list, matched, visited)) {
+      int slot_id = 0;
 
-    if (found) {
-      // mark the solution slot as found so we don't consider it again
-      //
-      ret_val = 1;
-      node_list[slot_id] = -1;
-      if (debug) {
-        printf("%s: PASS constraint set %d\n", __FUNCTION__, i);
+      while (matched[slot_id] != i) {
+        slot_id++;
       }
+      TRACE(TRACE_LEVEL_ALL, TRACE_CONSTRAINT, TRACE_REASON_PASS,
+            slot_id, -1, 0, i);
     } else {
       // if at any time during the check one of the constraints is not
       // matched then we can give up and fail
       //
       ret_val = 0;
-      if (debug) {
-        printf("%s: FAIL constraint set %d\n", __FUNCTION__, i);
-      }
+      TRACE(TRACE_LEVEL_ALL, TRACE_CONSTRAINT, TRACE_REASON_FAIL,
+            0, -1, 0, i);
       break;
     }
   }
 
+  safe_free(node_list);
+  safe_free(matched);
+  safe_free(visited);
   return ret_val;
 }
 
+float
+schedule_weight(int person_id, int slot_id)
+{
+  const sparse_row_t *row = NULL;
+
+  if (sched->weights[person_id]) {
+    return sched->weights[person_id][slot_id];
+  }
+
+  // sparse rows only hold a handful of slots, so a linear walk is
+  // cheaper than anything fancier
+  //
+  row = sched->sparse[person_id];
+  for (uint i = 0; i < row->num_values && row->slots[i] <= slot_id; i++) {
+    if (row->slots[i] == slot_id) {
+      return row->weights[i];
+    }
+  }
+
+  return SLOT_WEIGHT_INELIGIBLE;
+}
+
+int
+schedule_build_candidates(void)
+{
+  int slots = sched->num_slots;
+  int people = sched->num_people;
+  int *fill = NULL;
+  float w = 0;
+
+  if (sched->candidates_valid) {
+    return 0;
+  }
+
+  safe_free(sched->slot_offsets);
+  safe_free(sched->candidate_ids);
+  safe_free(sched->candidate_weights);
+
+  // only weights above the initial value can ever be picked by
+  // max_cost_for_slot, so everything else is left out of the lists
+  //
+  sched->slot_offsets = calloc(slots + 1, sizeof(int));
+
+  for (int i = 0; i < people; i++) {
+    if (sched->weights[i]) {
+      for (int j = 0; j < slots; j++) {
+        if (sched->weights[i][j] > SLOT_WEIGHT_INITIAL_VAL) {
+          sched->slot_offsets[j + 1]++;
+        }
+      }
+    } else {
+      for (uint j = 0; j < sched->sparse[i]->num_values; j++) {
+        if (sched->sparse[i]->weights[j] > SLOT_WEIGHT_INITIAL_VAL) {
+          sched->slot_offsets[sched->sparse[i]->slots[j] + 1]++;
+        }
+      }
+    }
+  }
+
+  for (int j = 0; j < slots; j++) {
+    sched->slot_offsets[j + 1] += sched->slot_offsets[j];
+  }
+
+  // people are walked in ascending order, so each slot list stays
+  // sorted by person_id and ties resolve the same way a full scan would
+  //
+  sched->candidate_ids = malloc(sizeof(int) * (sched->slot_offsets[slots] + 1));
+  sched->candidate_weights = malloc(sizeof(float) * (sched->slot_offsets[slots] + 1));
+  fill = malloc(sizeof(int) * (slots + 1));
+  memcpy(fill, sched->slot_offsets, sizeof(int) * (slots + 1));
+
+  for (int i = 0; i < people; i++) {
+    if (sched->weights[i]) {
+      for (int j = 0; j < slots; j++) {
+        w = sched->weights[i][j];
+        if (w > SLOT_WEIGHT_INITIAL_VAL) {
+          sched->candidate_ids[fill[j]] = i;
+          sched->candidate_weights[fill[j]++] = w;
+        }
+      }
+    } else {
+      for (uint j = 0; j < sched->sparse[i]->num_values; j++) {
+        int slot_id = sched->sparse[i]->slots[j];
+        w = sched->sparse[i]->weights[j];
+        if (w > SLOT_WEIGHT_INITIAL_VAL) {
+          sched->candidate_ids[fill[slot_id]] = i;
+          sched->candidate_weights[fill[slot_id]++] = w;
+        }
+      }
+    }
+  }
+
+  TRACE(TRACE_LEVEL_SEARCH, TRACE_CANDIDATES, TRACE_REASON_NONE,
+        slots, -1, 0, sched->slot_offsets[slots]);
+
+  safe_free(fill);
+  sched->candidates_valid = 1;
+  return 0;
+}
+
 float
 max_cost_for_slot(int slot_id, int* constraint_map, int *person_id)
 {
   float max = SLOT_WEIGHT_INITIAL_VAL;
+  int end = sched->slot_offsets[slot_id + 1];
   *person_id = -1;
 
-  for (int i = 0; i < sched->num_people; i++) {
-    if ((sched->weights[i][slot_id] > max) && (constraint_map[i] == 0)) {
-      max = sched->weights[i][slot_id];
-      *person_id = i;
+  for (int i = sched->slot_offsets[slot_id]; i < end; i++) {
+    if ((sched->candidate_weights[i] > max) &&
+        (constraint_map[sched->candidate_ids[i]] == 0)) {
+      max = sched->candidate_weights[i];
+      *person_id = sched->candidate_ids[i];
     }
   }
 
@@ -284,24 +835,23 @@ incumbent_update_and_prune(solution_t *s)
   while (!updated &&
          index < num_requested_solutions) {
 
-    if (debug) {
-      printf("comparing s->total_weight=%f, incumbent_set[index].total_weight=%f\n",
-             s->total_weight, incumbent_set[index].total_weight);
-    }
+    TRACE(TRACE_LEVEL_ALL, TRACE_COMPARE, TRACE_REASON_NONE,
+          s->total_depth, -1, incumbent_set[index].total_weight, index);
 
     if (s->total_weight > incumbent_set[index].total_weight &&
         solution_validates_constraints(s)) {
 
-      if (incumbent_count != 0) {
-        for (int i = incumbent_count-1; i > index; i--) {
-          incumbent_set[i] = incumbent_set[i-1];
-        }
-      }
-
       if (incumbent_count < num_requested_solutions) {
         incumbent_count++;
       }
 
+      // shift the worse solutions down, dropping the last one if the
+      // set was already full
+      //
+      for (int i = incumbent_count-1; i > index; i--) {
+        incumbent_set[i] = incumbent_set[i-1];
+      }
+
       incumbent_set[index] = *s;
       updated = 1;
     }
@@ -309,17 +859,14 @@ incumbent_update_and_prune(solution_t *s)
     index++;
   }
 
-  if (updated && debug) {
-    for (int i = 0; i < incumbent_count; i++) {
-      printf("%s: incumbent %d -> weight %1.3f, at depth %d\n",
-             __FUNCTION__, i, incumbent_set[i].total_weight,
-             incumbent_set[i].total_depth);
-    }
+  if (updated) {
+    TRACE(TRACE_LEVEL_SEARCH, TRACE_INCUMBENT, TRACE_REASON_NONE,
+          s->total_depth, -1, s->total_weight, index - 1);
   }
 
   // we are done with this branch
   //
-  prune_branch(s);
+  prune_branch(s, TRACE_REASON_LEAF);
 }
 
 int
@@ -329,6 +876,7 @@ create_root(solution_t **root)
   float weight = 0;
   int people = sched->num_people;
   int slots = sched->num_slots;
+  int *used = calloc(people, sizeof(int));
 
   // allocate the new root
   //
@@ -340,44 +888,62 @@ create_root(solution_t **root)
   (*root)->total_weight = 0;
   (*root)->total_depth = 0;
   (*root)->total_children = 0;
-  (*root)->used_person_id_map = calloc(people, sizeof(int));
   (*root)->node_list = calloc(slots, sizeof(node_t));
   (*root)->parent = NULL;
-  (*root)->children = malloc(sizeof(solution_t) * people);
+  (*root)->children = NULL;
 
   // fill in the root solution set
   //
   for (int i = 0; i < slots; i++) {
-    weight = max_cost_for_slot(i, (*root)->used_person_id_map, &id);
+    weight = max_cost_for_slot(i, used, &id);
     (*root)->node_list[i].person_id = id;
     (*root)->node_list[i].weight = weight;
     (*root)->total_weight += weight;
   }
 
+  safe_free(used);
   return 0;
 }
 
 int
 create_branch(solution_t *root, int depth)
 {
-  // make a new branch for each person_id based on the current depth
-  // and fill in 'randomly' with best-in-slot values for the remaining
-  // slots
+  // make a new branch for each person that can still take the slot at
+  // the current depth, and fill in 'randomly' with best-in-slot values
+  // for the remaining slots
   //
   int people = sched->num_people;
   int slots = sched->num_slots;
+  int start = sched->slot_offsets[depth];
+  int end = sched->slot_offsets[depth + 1];
+  int *used = NULL;
   solution_t *s;
 
-  for (int i = 0; i < people; i++) {
+  // children are only allocated once a branch is actually expanded,
+  // and only for the slot's candidates, packed in candidate order
+  //
+  if (!root->children) {
+    root->children = calloc(end - start + 1, sizeof(solution_t));
+  }
+
+  // one map of the locked people serves every child's fill
+  //
+  used = calloc(people, sizeof(int));
+  for (int j = 0; j < depth; j++) {
+    used[root->node_list[j].person_id] = 1;
+  }
 
-    if (root->used_person_id_map[i] == 1) {
+  for (int c = start; c < end; c++) {
+    int i = sched->candidate_ids[c];
+
+    if (used[i] == 1) {
       continue;
     }
 
     // add the new child root to its parent
     //
+    s = &(root->children[root->total_children]);
     root->total_children += 1;
-    s = &(root->children[i]);
 
     // set the attributes
     //
@@ -385,10 +951,9 @@ create_branch(solution_t *root, int depth)
     s->total_weight = 0;
     s->total_depth = depth + 1;
     s->total_children = 0;
-    s->used_person_id_map = calloc(people, sizeof(int));
     s->node_list = calloc(slots, sizeof(node_t));
     s->parent = root;
-    s->children = calloc(people, sizeof(solution_t));
+    s->children = NULL;
 
     // copy previously locked slots (if any)
     //
@@ -396,40 +961,43 @@ create_branch(solution_t *root, int depth)
       s->node_list[j].person_id = root->node_list[j].person_id;
       s->node_list[j].weight = root->node_list[j].weight;
       s->total_weight += root->node_list[j].weight;
-      s->used_person_id_map[root->node_list[j].person_id] = 1;
     }
 
     // set node for current slot
     //
     s->node_list[depth].person_id = i;
-    s->node_list[depth].weight = sched->weights[i][0];
-    s->total_weight += sched->weights[i][0];
-    s->used_person_id_map[i] = 1;
+    s->node_list[depth].weight = branch_weight(i, depth);
+    s->total_weight += s->node_list[depth].weight;
+    used[i] = 1;
 
     // fill in remaining slots
     //
     for (int j = depth + 1; j < slots; j++) {
       int id;
-      float weight = max_cost_for_slot(j, s->used_person_id_map, &id);
+      float weight = max_cost_for_slot(j, used, &id);
       s->node_list[j].person_id = id;
       s->node_list[j].weight = weight;
       s->total_weight += weight;
     }
 
+    used[i] = 0;
+
     // don't even bother with this solution if we already know it cannot
     // produce a better result
     //
+    TRACE(TRACE_LEVEL_NODES, TRACE_CREATE, TRACE_REASON_NONE,
+          depth + 1, i, s->total_weight, root->total_children);
+
     if (s->total_weight < incumbent_get_last_weight()) {
       s->active = 0;
-    }
-
-    if (debug) {
-      printf("%s: index: %d, active: %s, ",
-	     __FUNCTION__, i, s->active ? "true" : "false");
-      print_solution(s->node_list, slots);
+      TRACE(TRACE_LEVEL_NODES, TRACE_PRUNE, TRACE_REASON_BOUND,
+            depth + 1, i, s->total_weight, 0);
+    } else if (cache_prunes_branch(s)) {
+      s->active = 0;
     }
   }
 
+  safe_free(used);
   return 0;
 }
 
@@ -465,10 +1033,8 @@ select_branch(solution_t *branch, solution_t **new_root)
   }
 
   if (*new_root) {
-    if (debug) {
-      printf("%s: depth: %d, index: %d, weight: %1.3f\n",
-	     __FUNCTION__, (*new_root)->total_depth, index, weight);
-    }
+    TRACE(TRACE_LEVEL_NODES, TRACE_SELECT, TRACE_REASON_NONE,
+          (*new_root)->total_depth, index, weight, index);
     ret_val = 1;
   } else {
     *new_root = NULL;
@@ -479,7 +1045,7 @@ select_branch(solution_t *branch, solution_t **new_root)
 }
 
 int
-prune_branch(solution_t *branch)
+prune_branch(solution_t *branch, int reason)
 {
   if (branch) {
     for (int i = 0; i < branch->total_children; i++) {
@@ -487,10 +1053,8 @@ prune_branch(solution_t *branch)
     }
     branch->active = 0;
 
-    if (debug) {
-      printf("%s: depth %d, weight %1.3f\n",
-	     __FUNCTION__, branch->total_depth, branch->total_weight);
-    }
+    TRACE(TRACE_LEVEL_NODES, TRACE_PRUNE, reason, branch->total_depth,
+          -1, branch->total_weight, 0);
   }
   return 0;
 }
@@ -500,6 +1064,7 @@ expand_branch(solution_t *root, int depth)
 {
   int slots = sched->num_slots;
   solution_t *new_root = NULL;
+  float outer_best = 0;
 
   num_expanded_solutions++;
 
@@ -511,16 +1076,19 @@ expand_branch(solution_t *root, int depth)
     return 0;
   }
 
-  if (debug) {
-    printf("%s: new depth: %d, weight %1.3f\n",
-	   __FUNCTION__, depth+1, root->total_weight);
-  }
+  TRACE(TRACE_LEVEL_NODES, TRACE_EXPAND, TRACE_REASON_NONE,
+        depth + 1, -1, root->total_weight, 0);
+
+  // track the best leaf under this branch for the transposition cache
+  //
+  outer_best = cache.subtree_best;
+  cache.subtree_best = -FLT_MAX;
 
   create_branch(root, depth);
 
   // iterate on the branch as long as it is active
   //
-  while(root->active) {
+  while(root->active && !search_cancelled()) {
 
     if (!select_branch(root, &new_root) || !new_root) {
       root->active = 0;
@@ -528,6 +1096,9 @@ expand_branch(solution_t *root, int depth)
     }
 
     if (solution_is_feasible(new_root)) {
+      if (new_root->total_weight > cache.subtree_best) {
+        cache.subtree_best = new_root->total_weight;
+      }
       incumbent_update_and_prune(new_root);
     }
 
@@ -540,28 +1111,45 @@ expand_branch(solution_t *root, int depth)
     }
   }
 
+  // the branch is exhausted, so remember how far it could go for any
+  // other branch that locks the same people in a different order
+  //
+  if (depth > 0) {
+    cache_store(root, cache.subtree_best);
+  }
+
+  if (cache.subtree_best < outer_best) {
+    cache.subtree_best = outer_best;
+  }
+
   return 0;
 }
 
+int
+search_cancelled(void)
+{
+  // a batch being interrupted stops the exponential searches early; the
+  // caller discards whatever they found
+  //
+  return cancel != NULL && *cancel;
+}
+
 int
 free_branch(solution_t *root)
 {
   int i = 0;
+  int n = root->children ? root->total_children : 0;
 
   // walk the contents of the tree/branch and free all data structures
   //
-  while (i < root->total_children) {
+  while (i < n) {
     free_branch(&(root->children[i]));
-
-    if (debug) {
-      printf("%s: freed branch, depth %d, child %d\n",
-	     __FUNCTION__, root->total_depth, i);
-    }
+    TRACE(TRACE_LEVEL_ALL, TRACE_FREE, TRACE_REASON_NONE,
+          root->total_depth, i, 0, i);
 
     i++;
   }
 
-  safe_free(root->used_person_id_map);
   safe_free(root->node_list);
   safe_free(root->children);
 
@@ -569,79 +1157,2276 @@ free_branch(solution_t *root)
 }
 
 
-/*----------------------------------------------------------------------------*/
-/*----------------------------------------------------------------------------*/
-/*----------------------------------------------------------------------------*/
-/*----------------------------------------------------------------------------*/
-
+float
+root_bound(void)
+{
+  float bound = 0;
 
-// Defining a space for information and references about the module to
-// be stored internally
-//
-VALUE cBranchy = Qnil;
+  // best score any entity can add to each slot
+  //
+  for (int j = 0; j < sched->num_slots; j++) {
+    float best = SLOT_WEIGHT_INELIGIBLE;
 
-// Prototype for the initialization method - Ruby calls this, not you
-//
-void Init_branchy();
+    for (int i = 0; i < sched->num_people; i++) {
+      float w = schedule_weight(i, j);
 
-// schedule methods
-//
-VALUE method_schedule_create(VALUE self, VALUE number_of_slots);
-VALUE method_schedule_free(VALUE self);
-VALUE method_schedule_print(VALUE self);
-VALUE method_schedule_set_weight(VALUE self, VALUE weights, VALUE attribute_ids);
-VALUE method_schedule_set_constraints(VALUE self, VALUE constraints);
-VALUE method_schedule_compute_solution(VALUE self, 
-                                       VALUE number_of_solutions_to_find,
-                                       VALUE returned_weights_hash);
+      if (w > best) {
+        best = w;
+      }
+    }
 
+    if (best != SLOT_WEIGHT_INELIGIBLE) {
+      bound += best;
+    }
+  }
 
-// The initialization method for this module
-//
-void Init_branchy() {
-  cBranchy = rb_define_module("Branchy");
-  rb_define_method(cBranchy, "schedule_create", method_schedule_create, 1);
-  rb_define_method(cBranchy, "schedule_free", method_schedule_free, 0);
-  rb_define_method(cBranchy, "schedule_print", method_schedule_print, 0);
-  rb_define_method(cBranchy, "schedule_set_weight", method_schedule_set_weight, 2);
-  rb_define_method(cBranchy, "schedule_set_constraints", method_schedule_set_constraints, 1);
-  rb_define_method(cBranchy, "schedule_compute_solution", method_schedule_compute_solution, 2);
+  return bound;
 }
 
-VALUE method_schedule_create(VALUE self, VALUE number_of_slots) {
-  Check_Type(number_of_slots, T_FIXNUM);
-  sched = calloc(1, sizeof(schedule_t));
-  sched->num_people = 0;
-  sched->num_constraints = 0;
-  sched->num_slots = NUM2INT(number_of_slots);
-  sched->weights = NULL;
-  return Qnil;
+void
+heuristic_offer(solution_t *s)
+{
+  // the heuristic searches free branches as soon as they are done with
+  // them, so an incumbent gets its own copy of the node list
+  //
+  if (s->total_weight > incumbent_get_last_weight()) {
+    node_t *own = s->node_list;
+    node_t *copy = owned_list_new();
+
+    memcpy(copy, own, sched->num_slots * sizeof(node_t));
+    s->node_list = copy;
+    incumbent_update_and_prune(s);
+    s->node_list = own;
+  } else {
+    prune_branch(s, TRACE_REASON_BOUND);
+  }
 }
 
-VALUE method_schedule_free(VALUE self)
+node_t *
+owned_list_new(void)
 {
-  if (sched) {
-    for (int i = 0; i < sched->num_people; i++) {
-      safe_free(sched->weights[i]);
-      safe_free(sched->attribs[i]->values);
-      safe_free(sched->attribs[i]);
-    }
+  // a node list for an incumbent that is not backed by a tree branch,
+  // released once the incumbents have been exported
+  //
+  node_t *list = calloc(sched->num_slots, sizeof(node_t));
 
-    for (int i = 0; i < sched->num_constraints; i++) {
-      safe_free(sched->constraints[i]->values);
-      safe_free(sched->constraints[i]);
-    }
+  owned_lists = realloc(owned_lists, (owned_count + 1) * sizeof(node_t *));
+  owned_lists[owned_count++] = list;
 
-    safe_free(sched->weights);
-    safe_free(sched->attribs);
-    safe_free(sched->constraints);
+  return list;
+}
 
-    safe_free(sched);
+void
+owned_lists_free(void)
+{
+  for (int i = 0; i < owned_count; i++) {
+    safe_free(owned_lists[i]);
   }
-  return Qnil;
+  safe_free(owned_lists);
+  owned_count = 0;
 }
 
-VALUE method_schedule_print(VALUE self)
+int
+compare_branches(const solution_t **x, const solution_t **y)
+{
+  // best bound first, ties broken on the person locked last
+  //
+  if ((*x)->total_weight != (*y)->total_weight) {
+    return ((*x)->total_weight > (*y)->total_weight) ? -1 : 1;
+  }
+
+  return (*x)->node_list[(*x)->total_depth - 1].person_id -
+    (*y)->node_list[(*y)->total_depth - 1].person_id;
+}
+
+int
+beam_search(solution_t *root)
+{
+  int width = sched->search_limit;
+  int size = 1;
+  solution_t *beam = calloc(width, sizeof(solution_t));
+  solution_t *next = NULL;
+
+  // breadth first, one depth at a time, keeping only the 'width'
+  // branches with the best bound.  the kept branches are moved out of
+  // their parents so each depth can be freed once the next is built.
+  //
+  beam[0] = *root;
+  memset(root, 0, sizeof(solution_t));
+
+  for (int depth = 0; depth < sched->num_slots && size > 0; depth++) {
+    int next_size = 0;
+
+    next = calloc(width, sizeof(solution_t));
+
+    for (int b = 0; b < size; b++) {
+      num_expanded_solutions++;
+      create_branch(&beam[b], depth);
+
+      for (int i = 0; i < beam[b].total_children; i++) {
+        solution_t *s = &beam[b].children[i];
+        int worst = 0;
+
+        if (!s->node_list || !s->active) {
+          continue;
+        }
+
+        if (solution_is_feasible(s)) {
+          heuristic_offer(s);
+          continue;
+        }
+
+        if (s->total_weight <= incumbent_get_last_weight()) {
+          prune_branch(s, TRACE_REASON_BOUND);
+          continue;
+        }
+
+        if (next_size == width) {
+          for (int k = 1; k < width; k++) {
+            if (next[k].total_weight < next[worst].total_weight) {
+              worst = k;
+            }
+          }
+          if (next[worst].total_weight >= s->total_weight) {
+            prune_branch(s, TRACE_REASON_BEAM);
+            continue;
+          }
+          free_branch(&next[worst]);
+        } else {
+          worst = next_size++;
+        }
+
+        next[worst] = *s;
+        next[worst].parent = NULL;
+        memset(s, 0, sizeof(solution_t));
+      }
+
+      free_branch(&beam[b]);
+    }
+
+    safe_free(beam);
+    beam = next;
+    size = next_size;
+  }
+
+  for (int b = 0; b < size; b++) {
+    free_branch(&beam[b]);
+  }
+  safe_free(beam);
+
+  return 0;
+}
+
+int
+discrepancy_expand(solution_t *root, int depth, int budget)
+{
+  int count = 0;
+  solution_t **ranked = NULL;
+
+  num_expanded_solutions++;
+
+  if (depth == sched->num_slots || root->active == 0) {
+    return 0;
+  }
+
+  // depth first over the children in bound order.  taking the child
+  // ranked r (0 is the best bound) spends r of the remaining budget.
+  //
+  create_branch(root, depth);
+
+  ranked = calloc(root->total_children + 1, sizeof(solution_t *));
+  for (int i = 0; i < root->total_children; i++) {
+    if (root->children[i].node_list && root->children[i].active) {
+      ranked[count++] = &root->children[i];
+    }
+  }
+  qsort(ranked, count, sizeof(solution_t *),
+        (int(*) (const void *, const void *))compare_branches);
+
+  for (int r = 0; r < count && r <= budget; r++) {
+    solution_t *s = ranked[r];
+
+    if (s->total_weight <= incumbent_get_last_weight()) {
+      break;
+    }
+
+    if (solution_is_feasible(s)) {
+      heuristic_offer(s);
+    } else {
+      discrepancy_expand(s, depth + 1, budget - r);
+    }
+
+    free_branch(s);
+  }
+
+  safe_free(ranked);
+  for (int i = 0; i < root->total_children; i++) {
+    free_branch(&root->children[i]);
+  }
+  safe_free(root->children);
+  root->total_children = 0;
+  root->active = 0;
+
+  return 0;
+}
+
+context_t *
+context_copy(const context_t *c)
+{
+  context_t *copy = calloc(1, sizeof(context_t));
+
+  copy->num_values = c->num_values;
+  copy->values = calloc(c->num_values, sizeof(int));
+  memcpy(copy->values, c->values, sizeof(int) * c->num_values);
+
+  return copy;
+}
+
+schedule_t *
+schedule_new(int num_slots)
+{
+  schedule_t *s = calloc(1, sizeof(schedule_t));
+
+  s->num_people = 0;
+  s->num_constraints = 0;
+  s->num_slots = num_slots;
+  s->weights = NULL;
+  s->presolve = 1;
+
+  return s;
+}
+
+void
+schedule_destroy(schedule_t *s)
+{
+  for (int i = 0; i < s->num_people; i++) {
+    safe_free(s->weights[i]);
+    if (s->sparse[i]) {
+      safe_free(s->sparse[i]->slots);
+      safe_free(s->sparse[i]->weights);
+      safe_free(s->sparse[i]);
+    }
+    safe_free(s->attribs[i]->values);
+    safe_free(s->attribs[i]);
+  }
+
+  for (int i = 0; i < s->num_constraints; i++) {
+    safe_free(s->constraints[i]->values);
+    safe_free(s->constraints[i]);
+  }
+
+  safe_free(s->weights);
+  safe_free(s->sparse);
+  safe_free(s->attribs);
+  safe_free(s->constraints);
+  safe_free(s->slot_offsets);
+  safe_free(s->candidate_ids);
+  safe_free(s->candidate_weights);
+
+  free(s);
+}
+
+int
+compare_weights_desc(const float *x, const float *y)
+{
+  return (*x < *y) - (*x > *y);
+}
+
+int
+compare_people(const int *x, const int *y)
+{
+  // orders entities by weight row, then by (sorted) attribute set so
+  // that identical entities end up next to each other
+  //
+  for (int j = 0; j < sched->num_slots; j++) {
+    float wx = schedule_weight(*x, j);
+    float wy = schedule_weight(*y, j);
+    if (wx != wy) {
+      return (wx < wy) ? -1 : 1;
+    }
+  }
+
+  const context_t *ax = presolve_keys[*x];
+  const context_t *ay = presolve_keys[*y];
+
+  if (ax->num_values != ay->num_values) {
+    return (ax->num_values < ay->num_values) ? -1 : 1;
+  }
+
+  for (uint i = 0; i < ax->num_values; i++) {
+    if (ax->values[i] != ay->values[i]) {
+      return (ax->values[i] < ay->values[i]) ? -1 : 1;
+    }
+  }
+
+  return 0;
+}
+
+int
+person_meets_constraints(int person_id)
+{
+  for (int i = 0; i < sched->num_constraints; i++) {
+    if (compare_contexts(sched->constraints[i], sched->attribs[person_id])) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int
+presolve_run(presolve_t *pre, int num_solutions)
+{
+  int people = sched->num_people;
+  int slots = sched->num_slots;
+  int beaten_by = num_solutions + slots;
+  int class_limit = slots + num_solutions - 1;
+  int kept_people = 0;
+  int kept_slots = 0;
+  int changed = 0;
+  int *dropped = calloc(people, sizeof(int));
+  int *order = calloc(people, sizeof(int));
+  int *slot_index = calloc(slots, sizeof(int));
+  float *threshold = calloc(slots, sizeof(float));
+  float *sorted = NULL;
+  schedule_t *r = NULL;
+
+  memset(pre, 0, sizeof(presolve_t));
+  pre->fixed = malloc(sizeof(node_t) * (slots + 1));
+  for (int j = 0; j < slots; j++) {
+    pre->fixed[j].person_id = -1;
+    pre->fixed[j].weight = 0;
+  }
+
+  schedule_build_candidates();
+
+  // an entity beaten in every slot by at least num_solutions+num_slots
+  // others can always be swapped for a better unused entity, so it
+  // never shows up in the top solutions -- unless it is needed to
+  // cover one of the constraint sets
+  //
+  sorted = malloc(sizeof(float) * (sched->slot_offsets[slots] + 1));
+  for (int j = 0; j < slots; j++) {
+    int start = sched->slot_offsets[j];
+    int n = sched->slot_offsets[j + 1] - start;
+
+    threshold[j] = SLOT_WEIGHT_INELIGIBLE;
+    if (n >= beaten_by) {
+      memcpy(sorted, sched->candidate_weights + start, sizeof(float) * n);
+      qsort(sorted, n, sizeof(float),
+            (int(*) (const void *, const void *))compare_weights_desc);
+      threshold[j] = sorted[beaten_by - 1];
+    }
+  }
+
+  for (int i = 0; i < people; i++) {
+    int beaten = 1;
+
+    if (person_meets_constraints(i)) {
+      continue;
+    }
+
+    for (int j = 0; j < slots && beaten; j++) {
+      float w = schedule_weight(i, j);
+      if (w > SLOT_WEIGHT_INITIAL_VAL && !(w < threshold[j])) {
+        beaten = 0;
+      }
+    }
+
+    if (beaten) {
+      dropped[i] = 1;
+      stats.dominated++;
+      TRACE(TRACE_LEVEL_SEARCH, TRACE_PRESOLVE, TRACE_REASON_DOMINATED,
+            0, i, 0, -1);
+    }
+  }
+
+  // entities with identical weights and attributes are interchangeable.
+  // a single solution uses at most num_slots of them, and every pattern
+  // that uses them can be permuted into num_solutions distinct solutions
+  // with num_slots+num_solutions-1 copies, so the rest are dropped.
+  //
+  presolve_keys = calloc(people, sizeof(context_t *));
+  for (int i = 0; i < people; i++) {
+    presolve_keys[i] = context_copy(sched->attribs[i]);
+    qsort(presolve_keys[i]->values, presolve_keys[i]->num_values, sizeof(int),
+          (int(*) (const void *, const void *))compare);
+    if (!dropped[i]) {
+      order[kept_people++] = i;
+    }
+  }
+
+  qsort(order, kept_people, sizeof(int),
+        (int(*) (const void *, const void *))compare_people);
+
+  for (int i = 0; i < kept_people; ) {
+    int n = 1;
+
+    while (i + n < kept_people && compare_people(&order[i], &order[i + n]) == 0) {
+      n++;
+    }
+
+    if (n > 1) {
+      stats.classes++;
+
+      // keep the lowest person_ids of the class, which are the ones
+      // the search would have preferred on ties anyway
+      //
+      qsort(order + i, n, sizeof(int),
+            (int(*) (const void *, const void *))compare);
+
+      for (int j = class_limit; j < n; j++) {
+        dropped[order[i + j]] = 1;
+        stats.duplicates++;
+        TRACE(TRACE_LEVEL_SEARCH, TRACE_PRESOLVE, TRACE_REASON_DUPLICATE,
+              0, order[i + j], 0, order[i]);
+      }
+    }
+
+    i += n;
+  }
+
+  // a slot with a single eligible entity left has to go to that entity.
+  // constraints are checked over the whole solution, so slots are only
+  // fixed when there are none to check.
+  //
+  changed = (sched->num_constraints == 0);
+  while (changed) {
+    changed = 0;
+
+    for (int j = 0; j < slots; j++) {
+      int n = 0;
+      int id = -1;
+
+      if (pre->fixed[j].person_id >= 0) {
+        continue;
+      }
+
+      for (int k = sched->slot_offsets[j]; k < sched->slot_offsets[j + 1]; k++) {
+        if (!dropped[sched->candidate_ids[k]]) {
+          id = sched->candidate_ids[k];
+          n++;
+        }
+      }
+
+      if (n == 1) {
+        pre->fixed[j].person_id = id;
+        pre->fixed[j].weight = schedule_weight(id, j);
+        pre->fixed_weight += pre->fixed[j].weight;
+        dropped[id] = 1;
+        stats.fixed_slots++;
+        changed = 1;
+        TRACE(TRACE_LEVEL_SEARCH, TRACE_PRESOLVE, TRACE_REASON_FORCED,
+              j, id, pre->fixed[j].weight, -1);
+      }
+    }
+  }
+
+  for (int i = 0; i < people; i++) {
+    safe_free(presolve_keys[i]->values);
+    safe_free(presolve_keys[i]);
+  }
+  safe_free(presolve_keys);
+  safe_free(sorted);
+  safe_free(threshold);
+
+  if (stats.dominated + stats.duplicates + stats.fixed_slots == 0) {
+    safe_free(dropped);
+    safe_free(order);
+    safe_free(slot_index);
+    return 0;
+  }
+
+  // build the reduced schedule the search runs on
+  //
+  pre->person_map = calloc(people, sizeof(int));
+  pre->slot_map = calloc(slots, sizeof(int));
+
+  for (int j = 0; j < slots; j++) {
+    slot_index[j] = -1;
+    if (pre->fixed[j].person_id < 0) {
+      slot_index[j] = kept_slots;
+      pre->slot_map[kept_slots++] = j;
+    }
+  }
+
+  kept_people = 0;
+  for (int i = 0; i < people; i++) {
+    if (!dropped[i]) {
+      pre->person_map[kept_people++] = i;
+    }
+  }
+
+  r = calloc(1, sizeof(schedule_t));
+  r->num_people = kept_people;
+  r->num_slots = kept_slots;
+  r->num_constraints = sched->num_constraints;
+  r->cache_bytes = sched->cache_bytes;
+  r->search_mode = sched->search_mode;
+  r->search_limit = sched->search_limit;
+  r->weights = calloc(kept_people + 1, sizeof(float *));
+  r->sparse = calloc(kept_people + 1, sizeof(sparse_row_t *));
+  r->attribs = calloc(kept_people + 1, sizeof(context_t *));
+  r->constraints = calloc(sched->num_constraints + 1, sizeof(context_t *));
+
+  for (int i = 0; i < kept_people; i++) {
+    int id = pre->person_map[i];
+
+    if (sched->weights[id]) {
+      r->weights[i] = calloc(kept_slots + 1, sizeof(float));
+      for (int j = 0; j < kept_slots; j++) {
+        r->weights[i][j] = sched->weights[id][pre->slot_map[j]];
+      }
+    } else {
+      const sparse_row_t *row = sched->sparse[id];
+      sparse_row_t *copy = calloc(1, sizeof(sparse_row_t));
+
+      copy->slots = calloc(row->num_values + 1, sizeof(int));
+      copy->weights = calloc(row->num_values + 1, sizeof(float));
+      for (uint j = 0; j < row->num_values; j++) {
+        if (slot_index[row->slots[j]] >= 0) {
+          copy->slots[copy->num_values] = slot_index[row->slots[j]];
+          copy->weights[copy->num_values++] = row->weights[j];
+        }
+      }
+      r->sparse[i] = copy;
+    }
+
+    r->attribs[i] = context_copy(sched->attribs[id]);
+  }
+
+  for (int i = 0; i < sched->num_constraints; i++) {
+    r->constraints[i] = context_copy(sched->constraints[i]);
+  }
+
+  TRACE(TRACE_LEVEL_SEARCH, TRACE_PRESOLVE, TRACE_REASON_REDUCED,
+        kept_slots, -1, pre->fixed_weight, kept_people);
+
+  pre->reduced = r;
+  safe_free(dropped);
+  safe_free(order);
+  safe_free(slot_index);
+  return 0;
+}
+
+void
+presolve_free(presolve_t *pre)
+{
+  if (pre->reduced) {
+    schedule_destroy(pre->reduced);
+    pre->reduced = NULL;
+  }
+
+  safe_free(pre->person_map);
+  safe_free(pre->slot_map);
+  safe_free(pre->fixed);
+}
+
+int
+incumbent_export(result_t *r, const presolve_t *pre)
+{
+  // copy the incumbent solutions into a flat result, mapping any
+  // reduced ids back to the ids of the schedule the caller built
+  //
+  int slots = sched->num_slots;
+  const schedule_t *reduced = pre ? pre->reduced : NULL;
+
+  r->count = incumbent_count;
+  r->num_slots = slots;
+
+  if (reduced && reduced->num_slots == 0) {
+    // every slot was forced, so there is exactly one solution
+    //
+    r->count = (slots > 0 && pre->fixed_weight > 0) ? 1 : 0;
+  }
+
+  r->nodes = calloc(r->count * slots + 1, sizeof(node_t));
+  r->total_weights = calloc(r->count + 1, sizeof(float));
+
+  for (int i = 0; i < r->count; i++) {
+    node_t *nodes = r->nodes + i * slots;
+
+    if (!reduced) {
+      memcpy(nodes, incumbent_set[i].node_list, sizeof(node_t) * slots);
+      r->total_weights[i] = incumbent_set[i].total_weight;
+      continue;
+    }
+
+    memcpy(nodes, pre->fixed, sizeof(node_t) * slots);
+    r->total_weights[i] = pre->fixed_weight;
+
+    if (reduced->num_slots == 0) {
+      continue;
+    }
+
+    for (int j = 0; j < reduced->num_slots; j++) {
+      node_t n = incumbent_set[i].node_list[j];
+      nodes[pre->slot_map[j]].person_id =
+        (n.person_id < 0) ? -1 : pre->person_map[n.person_id];
+      nodes[pre->slot_map[j]].weight = n.weight;
+    }
+    r->total_weights[i] += incumbent_set[i].total_weight;
+  }
+
+  return 0;
+}
+
+void
+result_free(result_t *r)
+{
+  safe_free(r->nodes);
+  safe_free(r->total_weights);
+  r->count = 0;
+}
+
+float
+branch_weight(int person_id, int depth)
+{
+  // weight given to the person locked into the slot at 'depth' when a
+  // branch is created, which is the person's weight in that slot.  the
+  // bound tables below score locked slots the same way.
+  //
+  return schedule_weight(person_id, depth);
+}
+
+uint64_t
+mix_person(uint64_t x)
+{
+  // splitmix64 finalizer
+  //
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+int
+cache_init(long max_bytes)
+{
+  int people = sched->num_people;
+  uint64_t entries = 1;
+
+  memset(&cache, 0, sizeof(cache_t));
+  cache.subtree_best = -FLT_MAX;
+
+  if (max_bytes <= 0) {
+    return 0;
+  }
+
+  // small schedules get the exact subset table: one completion value
+  // per set of locked people, which makes every bound exact
+  //
+  if (people <= CACHE_DP_MAX_PEOPLE &&
+      ((long)sizeof(float) << people) <= max_bytes) {
+    int ok = 1;
+
+    cache.dp = malloc(sizeof(float) << people);
+    cache.dp_ids = calloc(sched->num_slots + 1, sizeof(int));
+    cache.dp_maps = calloc(sched->num_slots + 1, sizeof(int *));
+    ok = cache.dp && cache.dp_ids && cache.dp_maps;
+    for (int i = 0; ok && i <= sched->num_slots; i++) {
+      cache.dp_maps[i] = calloc(people + 1, sizeof(int));
+      ok = cache.dp_maps[i] != NULL;
+    }
+
+    // without the whole table the search just runs uncached
+    //
+    if (!ok) {
+      cache_free();
+      return 0;
+    }
+
+    for (uint64_t i = 0; i < ((uint64_t)1 << people); i++) {
+      cache.dp[i] = NAN;
+    }
+
+    return 0;
+  }
+
+  while (entries * 2 * sizeof(cache_entry_t) <= (uint64_t)max_bytes) {
+    entries *= 2;
+  }
+
+  if (entries < CACHE_PROBES) {
+    return 0;
+  }
+
+  cache.entries = calloc(entries, sizeof(cache_entry_t));
+  if (cache.entries) {
+    cache.mask = entries - 1;
+  }
+  return 0;
+}
+
+void
+cache_free(void)
+{
+  if (cache.dp_maps) {
+    for (int i = 0; i <= sched->num_slots; i++) {
+      safe_free(cache.dp_maps[i]);
+    }
+  }
+
+  safe_free(cache.dp_maps);
+  safe_free(cache.dp_ids);
+  safe_free(cache.dp);
+  safe_free(cache.entries);
+}
+
+float
+cache_completion(uint64_t mask, int depth)
+{
+  // best weight any leaf below a branch with the people in 'mask'
+  // locked into the first 'depth' slots can add, following the same
+  // rules as create_branch/select_branch
+  //
+  int people = sched->num_people;
+  int slots = sched->num_slots;
+  int *map = cache.dp_maps[depth];
+  int unique = 1;
+  float fill = 0;
+  float best = -FLT_MAX;
+
+  if (depth == slots) {
+    return 0;
+  }
+
+  if (!isnan(cache.dp[mask])) {
+    return cache.dp[mask];
+  }
+
+  stats.dp_states++;
+
+  for (int i = 0; i < people; i++) {
+    map[i] = (mask >> i) & 1;
+  }
+
+  // a branch whose best-in-slot fill is already unique is a leaf
+  //
+  for (int j = depth; j < slots; j++) {
+    int *id = &cache.dp_ids[j];
+    fill += max_cost_for_slot(j, map, id);
+    for (int k = depth; k < j && unique; k++) {
+      unique = (cache.dp_ids[k] != *id);
+    }
+    if (*id < 0) {
+      unique = 0;
+    }
+  }
+
+  if (unique) {
+    cache.dp[mask] = fill;
+    return fill;
+  }
+
+  // otherwise it is worth the best of its children, one for each of
+  // the slot's candidates that is not locked yet
+  //
+  for (int c = sched->slot_offsets[depth]; c < sched->slot_offsets[depth + 1]; c++) {
+    int i = sched->candidate_ids[c];
+
+    if ((mask >> i) & 1) {
+      continue;
+    }
+
+    float w = branch_weight(i, depth) +
+      cache_completion(mask | ((uint64_t)1 << i), depth + 1);
+    if (w > best) {
+      best = w;
+    }
+  }
+
+  cache.dp[mask] = best;
+  return best;
+}
+
+float
+cache_lookup(const solution_t *s, int *found)
+{
+  uint64_t k0 = 0;
+  uint64_t k1 = 0;
+  uint64_t mask = 0;
+  int depth = s->total_depth;
+  cache_entry_t *e = NULL;
+
+  *found = 0;
+
+  if (cache.dp) {
+    for (int j = 0; j < depth; j++) {
+      mask |= (uint64_t)1 << s->node_list[j].person_id;
+    }
+    *found = 1;
+    return cache_completion(mask, depth);
+  }
+
+  // the fingerprint is order independent, so every ordering of the same
+  // locked people lands on the same entry
+  //
+  for (int j = 0; j < depth; j++) {
+    k0 += mix_person(s->node_list[j].person_id);
+    k1 ^= mix_person(s->node_list[j].person_id + 0x632be59bd9b4e019ULL);
+  }
+
+  for (int p = 0; p < CACHE_PROBES; p++) {
+    e = &cache.entries[(k0 + p) & cache.mask];
+    if (e->depth == depth && e->key[0] == k0 && e->key[1] == k1) {
+      *found = 1;
+      return e->bound;
+    }
+  }
+
+  return 0;
+}
+
+void
+cache_store(const solution_t *s, float best)
+{
+  uint64_t k0 = 0;
+  uint64_t k1 = 0;
+  int depth = s->total_depth;
+  float locked = 0;
+  float bound = 0;
+  cache_entry_t *e = NULL;
+  cache_entry_t *victim = NULL;
+
+  if (!cache.entries) {
+    return;
+  }
+
+  // nothing below the branch beat the incumbent floor at the time it
+  // was pruned, so the completion is bounded by the best leaf found or
+  // the current floor, whichever is higher
+  //
+  if (best < incumbent_get_last_weight()) {
+    best = incumbent_get_last_weight();
+  }
+
+  for (int j = 0; j < depth; j++) {
+    locked += s->node_list[j].weight;
+    k0 += mix_person(s->node_list[j].person_id);
+    k1 ^= mix_person(s->node_list[j].person_id + 0x632be59bd9b4e019ULL);
+  }
+
+  bound = best - locked;
+
+  for (int p = 0; p < CACHE_PROBES; p++) {
+    e = &cache.entries[(k0 + p) & cache.mask];
+
+    if (e->depth == depth && e->key[0] == k0 && e->key[1] == k1) {
+      if (bound < e->bound) {
+        e->bound = bound;
+      }
+      return;
+    }
+  }
+
+  // take an empty entry if there is one, otherwise replace the deepest
+  // one since its branch is the cheapest to explore again
+  //
+  for (int p = 0; p < CACHE_PROBES; p++) {
+    e = &cache.entries[(k0 + p) & cache.mask];
+
+    if (e->depth == 0) {
+      victim = e;
+      break;
+    }
+
+    if (!victim || e->depth > victim->depth) {
+      victim = e;
+    }
+  }
+
+  if (victim->depth != 0) {
+    stats.cache_evictions++;
+  }
+
+  victim->key[0] = k0;
+  victim->key[1] = k1;
+  victim->depth = depth;
+  victim->bound = bound;
+  stats.cache_stores++;
+}
+
+int
+cache_prunes_branch(const solution_t *s)
+{
+  int found = 0;
+  float locked = 0;
+  float bound = 0;
+
+  if (!cache.dp && !cache.entries) {
+    return 0;
+  }
+
+  stats.cache_lookups++;
+  bound = cache_lookup(s, &found);
+  if (!found) {
+    return 0;
+  }
+
+  stats.cache_hits++;
+
+  for (int j = 0; j < s->total_depth; j++) {
+    locked += s->node_list[j].weight;
+  }
+
+  // the slack keeps summation order differences from pruning a tie
+  //
+  if (locked + bound + CACHE_BOUND_SLACK < incumbent_get_last_weight()) {
+    stats.cache_prunes++;
+    TRACE(TRACE_LEVEL_NODES, TRACE_PRUNE, TRACE_REASON_CACHE,
+          s->total_depth, -1, locked + bound, 0);
+    return 1;
+  }
+
+  return 0;
+}
+
+int
+small_kernel_fits(void)
+{
+  return sched->num_people <= SMALL_MAX_PEOPLE &&
+    sched->num_slots > 0 && sched->num_slots <= SMALL_MAX_SLOTS &&
+    sched->search_mode == SEARCH_EXACT &&
+    !cache.dp && !cache.entries;
+}
+
+int
+compare_candidates(const int *x, const int *y)
+{
+  // candidate list entries of the slot being sorted, best first
+  //
+  float wx = sched->candidate_weights[*x];
+  float wy = sched->candidate_weights[*y];
+
+  if (wx != wy) {
+    return (wx > wy) ? -1 : 1;
+  }
+
+  return sched->candidate_ids[*x] - sched->candidate_ids[*y];
+}
+
+small_arena_t *
+small_arena_get(void)
+{
+  int people = sched->num_people;
+  int slots = sched->num_slots;
+  int order[SMALL_MAX_PEOPLE];
+
+  // each thread keeps one arena and reuses it from solve to solve;
+  // every field is rewritten before the kernel reads it
+  //
+  if (!small_scratch) {
+    small_scratch = calloc(1, sizeof(small_arena_t));
+  }
+
+  small_arena_t *a = small_scratch;
+
+  if (a->incumbents_size < num_requested_solutions) {
+    a->incumbents =
+      realloc(a->incumbents, num_requested_solutions * sizeof(small_node_t));
+    a->incumbents_size = num_requested_solutions;
+  }
+
+  a->num_people = people;
+  a->num_slots = slots;
+
+  for (int i = 0; i < num_requested_solutions; i++) {
+    a->incumbents[i].total_weight = incumbent_set[i].total_weight;
+  }
+
+  for (int j = 0; j < slots; j++) {
+    int start = sched->slot_offsets[j];
+    int n = sched->slot_offsets[j + 1] - start;
+
+    for (int k = 0; k < n; k++) {
+      order[k] = start + k;
+    }
+    qsort(order, n, sizeof(int),
+          (int(*) (const void *, const void *))compare_candidates);
+
+    a->num_candidates[j] = n;
+    for (int k = 0; k < n; k++) {
+      a->candidate_ids[j][k] = sched->candidate_ids[order[k]];
+      a->candidate_weights[j][k] = sched->candidate_weights[order[k]];
+    }
+
+    for (int k = 0; k < n; k++) {
+      int id = sched->candidate_ids[start + k];
+      a->lock_ids[j][k] = id;
+      a->lock_weights[j][k] = branch_weight(id, j);
+    }
+  }
+
+  return a;
+}
+
+float
+small_fill(const small_arena_t *a, small_node_t *s, int from)
+{
+  // best-in-slot fill, same as max_cost_for_slot over the used set
+  //
+  float total = 0;
+
+  for (int j = from; j < a->num_slots; j++) {
+    s->node_list[j].person_id = -1;
+    s->node_list[j].weight = SLOT_WEIGHT_INITIAL_VAL;
+
+    for (int k = 0; k < a->num_candidates[j]; k++) {
+      int id = a->candidate_ids[j][k];
+      if (!((s->used >> id) & 1)) {
+        s->node_list[j].person_id = id;
+        s->node_list[j].weight = a->candidate_weights[j][k];
+        break;
+      }
+    }
+
+    total += s->node_list[j].weight;
+  }
+
+  return total;
+}
+
+int
+small_select_branch(small_arena_t *a, small_node_t *root, int depth,
+                    small_node_t **new_root)
+{
+  float weight = SLOT_WEIGHT_INITIAL_VAL;
+  float last = a->incumbents[num_requested_solutions - 1].total_weight;
+  small_node_t *children = a->children[depth];
+
+  *new_root = NULL;
+
+  for (int i = 0; i < root->total_children; i++) {
+    if (children[i].active == 1 &&
+        children[i].total_weight > weight &&
+        children[i].total_weight > last) {
+      weight = children[i].total_weight;
+      *new_root = &children[i];
+    }
+  }
+
+  if (*new_root) {
+    TRACE(TRACE_LEVEL_NODES, TRACE_SELECT, TRACE_REASON_NONE,
+          depth + 1, (int)(*new_root - children), weight,
+          (int)(*new_root - children));
+  }
+
+  return *new_root != NULL;
+}
+
+void
+small_incumbent_update_and_prune(small_arena_t *a, small_node_t *s)
+{
+  int updated = 0;
+  int index = 0;
+  solution_t view;
+
+  // same update rules as incumbent_update_and_prune
+  //
+  memset(&view, 0, sizeof(solution_t));
+  view.node_list = s->node_list;
+
+  while (!updated &&
+         index < num_requested_solutions) {
+
+    if (s->total_weight > a->incumbents[index].total_weight &&
+        solution_validates_constraints(&view)) {
+
+      if (incumbent_count < num_requested_solutions) {
+        incumbent_count++;
+      }
+
+      // shift the worse solutions down, dropping the last one if the
+      // set was already full
+      //
+      for (int i = incumbent_count-1; i > index; i--) {
+        a->incumbents[i] = a->incumbents[i-1];
+      }
+
+      a->incumbents[index] = *s;
+      updated = 1;
+      TRACE(TRACE_LEVEL_SEARCH, TRACE_INCUMBENT, TRACE_REASON_NONE,
+            sched->num_slots, -1, s->total_weight, index);
+    }
+
+    index++;
+  }
+
+  s->active = 0;
+}
+
+// Generates the search for schedules of up to N slots.  The slot loops
+// have a constant bound so the compiler can unroll them, and the used
+// set is a single 64 bit word.
+//
+#define SMALL_KERNEL(N)                                                      \
+                                                                             \
+  static int                                                                 \
+  small_is_feasible_##N(const small_arena_t *a, const small_node_t *s)       \
+  {                                                                          \
+    uint64_t seen = 0;                                                       \
+    int count = 0;                                                           \
+                                                                             \
+    for (int j = 0; j < N; j++) {                                            \
+      if (j >= a->num_slots) {                                               \
+        break;                                                               \
+      }                                                                      \
+      int p = s->node_list[j].person_id;                                     \
+      if (p >= 0 && !((seen >> p) & 1)) {                                    \
+        seen |= (uint64_t)1 << p;                                            \
+        count++;                                                             \
+      }                                                                      \
+    }                                                                        \
+                                                                             \
+    return count == a->num_slots;                                            \
+  }                                                                          \
+                                                                             \
+  static void                                                                \
+  small_create_branch_##N(small_arena_t *a, small_node_t *root, int depth)   \
+  {                                                                          \
+    small_node_t *children = a->children[depth];                             \
+    float last = a->incumbents[num_requested_solutions - 1].total_weight;    \
+                                                                             \
+    root->total_children = 0;                                                \
+                                                                             \
+    for (int c = 0; c < a->num_candidates[depth]; c++) {                     \
+      int i = a->lock_ids[depth][c];                                         \
+      small_node_t *s = &children[root->total_children];                     \
+                                                                             \
+      if ((root->used >> i) & 1) {                                           \
+        continue;                                                            \
+      }                                                                      \
+                                                                             \
+      root->total_children += 1;                                             \
+      s->active = 1;                                                         \
+      s->total_children = 0;                                                 \
+      s->total_weight = 0;                                                   \
+      s->used = root->used | ((uint64_t)1 << i);                             \
+                                                                             \
+      for (int j = 0; j < N; j++) {                                          \
+        if (j >= depth) {                                                    \
+          break;                                                             \
+        }                                                                    \
+        s->node_list[j] = root->node_list[j];                                \
+        s->total_weight += root->node_list[j].weight;                        \
+      }                                                                      \
+                                                                             \
+      s->node_list[depth].person_id = i;                                     \
+      s->node_list[depth].weight = a->lock_weights[depth][c];                \
+      s->total_weight += s->node_list[depth].weight;                         \
+                                                                             \
+      for (int j = depth + 1; j < N; j++) {                                  \
+        if (j >= a->num_slots) {                                             \
+          break;                                                             \
+        }                                                                    \
+        node_t *n = &s->node_list[j];                                        \
+        n->person_id = -1;                                                   \
+        n->weight = SLOT_WEIGHT_INITIAL_VAL;                                 \
+        for (int k = 0; k < a->num_candidates[j]; k++) {                     \
+          int id = a->candidate_ids[j][k];                                   \
+          if (!((s->used >> id) & 1)) {                                      \
+            n->person_id = id;                                               \
+            n->weight = a->candidate_weights[j][k];                          \
+            break;                                                           \
+          }                                                                  \
+        }                                                                    \
+        s->total_weight += n->weight;                                        \
+      }                                                                      \
+                                                                             \
+      TRACE(TRACE_LEVEL_NODES, TRACE_CREATE, TRACE_REASON_NONE,              \
+            depth + 1, i, s->total_weight, root->total_children);            \
+                                                                             \
+      if (s->total_weight < last) {                                          \
+        s->active = 0;                                                       \
+        TRACE(TRACE_LEVEL_NODES, TRACE_PRUNE, TRACE_REASON_BOUND,            \
+              depth + 1, i, s->total_weight, 0);                             \
+      }                                                                      \
+    }                                                                        \
+  }                                                                          \
+                                                                             \
+  static void                                                                \
+  small_expand_branch_##N(small_arena_t *a, small_node_t *root, int depth)   \
+  {                                                                          \
+    small_node_t *new_root = NULL;                                           \
+                                                                             \
+    num_expanded_solutions++;                                                \
+                                                                             \
+    if (depth == a->num_slots || root->active == 0) {                        \
+      return;                                                                \
+    }                                                                        \
+                                                                             \
+    TRACE(TRACE_LEVEL_NODES, TRACE_EXPAND, TRACE_REASON_NONE,                \
+          depth + 1, -1, root->total_weight, 0);                             \
+                                                                             \
+    small_create_branch_##N(a, root, depth);                                 \
+                                                                             \
+    while (root->active && !search_cancelled()) {                            \
+      int active = 0;                                                        \
+                                                                             \
+      if (!small_select_branch(a, root, depth, &new_root)) {                 \
+        root->active = 0;                                                    \
+        break;                                                               \
+      }                                                                      \
+                                                                             \
+      if (small_is_feasible_##N(a, new_root)) {                              \
+        small_incumbent_update_and_prune(a, new_root);                       \
+      }                                                                      \
+                                                                             \
+      if (new_root->active) {                                                \
+        small_expand_branch_##N(a, new_root, depth + 1);                     \
+      }                                                                      \
+                                                                             \
+      for (int i = 0; i < root->total_children && !active; i++) {            \
+        active = a->children[depth][i].active;                               \
+      }                                                                      \
+                                                                             \
+      if (!active) {                                                         \
+        root->active = 0;                                                    \
+      }                                                                      \
+    }                                                                        \
+  }
+
+SMALL_KERNEL(4)
+SMALL_KERNEL(8)
+SMALL_KERNEL(16)
+
+int
+small_search(small_arena_t *a)
+{
+  // root branch, then the kernel for the smallest size class that fits
+  //
+  a->root.active = 1;
+  a->root.used = 0;
+  a->root.total_weight = small_fill(a, &a->root, 0);
+
+  if (a->num_slots <= 4) {
+    small_expand_branch_4(a, &a->root, 0);
+  } else if (a->num_slots <= 8) {
+    small_expand_branch_8(a, &a->root, 0);
+  } else {
+    small_expand_branch_16(a, &a->root, 0);
+  }
+
+  // hand the results back through the incumbent set so they are
+  // exported like the tree's
+  //
+  for (int i = 0; i < num_requested_solutions; i++) {
+    incumbent_set[i].total_weight = a->incumbents[i].total_weight;
+    incumbent_set[i].node_list = a->incumbents[i].node_list;
+  }
+
+  return 0;
+}
+
+int
+murty_fits(void)
+{
+  return sched->num_constraints == 0 &&
+    sched->search_mode == SEARCH_EXACT &&
+    sched->num_slots > 0;
+}
+
+int
+assignment_alloc(assignment_t *a, int k)
+{
+  a->col_for_row = calloc(k, sizeof(int));
+  a->u = calloc(k, sizeof(double));
+  a->v = calloc(k, sizeof(double));
+  a->forced = calloc(k, sizeof(char));
+
+  return a->col_for_row && a->u && a->v && a->forced;
+}
+
+void
+assignment_free(assignment_t *a)
+{
+  safe_free(a->col_for_row);
+  safe_free(a->u);
+  safe_free(a->v);
+  safe_free(a->forced);
+}
+
+void
+assignment_copy(assignment_t *dst, const assignment_t *src, int k)
+{
+  dst->parent = src->parent;
+  dst->forbid_row = src->forbid_row;
+  dst->forbid_col = src->forbid_col;
+  dst->forbid_cand = src->forbid_cand;
+  dst->weight = src->weight;
+  memcpy(dst->col_for_row, src->col_for_row, k * sizeof(int));
+  memcpy(dst->u, src->u, k * sizeof(double));
+  memcpy(dst->v, src->v, k * sizeof(double));
+  memcpy(dst->forced, src->forced, k * sizeof(char));
+}
+
+int
+murty_init(murty_t *m)
+{
+  int n = sched->num_people;
+  int k = sched->num_slots;
+  int num_candidates = sched->slot_offsets[k];
+  float shift = 0;
+  assignment_t *first = NULL;
+
+  memset(m, 0, sizeof(murty_t));
+  m->n = n;
+  m->k = k;
+
+  if (k > n) {
+    return 0;
+  }
+
+  // one row per slot and one column per person; people left over stay
+  // unmatched.  weights are flipped into non-negative
+  // costs, kept next to the slot's candidates.  returns -1 when the
+  // tables do not fit, so the caller can search the tree instead.
+  //
+  m->forbid = calloc(num_candidates + 1, sizeof(char));
+  m->cost = calloc(num_candidates + 1, sizeof(double));
+  m->locked = calloc(n, sizeof(char));
+  m->row_for_col = malloc(n * sizeof(int));
+  m->v = calloc(n, sizeof(double));
+  m->dist = calloc(n, sizeof(double));
+  m->path = calloc(n, sizeof(int));
+  m->remaining = calloc(k + 1, sizeof(int));
+  m->row_seen = calloc(k, sizeof(char));
+  m->col_seen = calloc(n, sizeof(char));
+  m->solved = calloc(1, sizeof(assignment_t));
+
+  if (!m->forbid || !m->cost || !m->locked || !m->row_for_col || !m->v ||
+      !m->dist || !m->path || !m->remaining || !m->row_seen ||
+      !m->col_seen || !m->solved) {
+    return -1;
+  }
+
+  m->num_solved = 1;
+  first = &m->solved[0];
+  if (!assignment_alloc(&m->scratch, k) || !assignment_alloc(first, k)) {
+    return -1;
+  }
+
+  for (int i = 0; i < num_candidates; i++) {
+    if (sched->candidate_weights[i] > shift) {
+      shift = sched->candidate_weights[i];
+    }
+  }
+
+  for (int c = 0; c < num_candidates; c++) {
+    m->cost[c] = (double)shift - sched->candidate_weights[c];
+  }
+  for (int i = 0; i < n; i++) {
+    m->row_for_col[i] = -1;
+  }
+
+  // the best assignment, one row at a time from an empty matching
+  //
+  first->parent = -1;
+  first->forbid_row = -1;
+
+  for (int j = 0; j < k; j++) {
+    first->col_for_row[j] = -1;
+  }
+
+  for (int j = 0; j < k; j++) {
+    if (!murty_augment(m, first, j, -1)) {
+      return 0;
+    }
+  }
+
+  for (int j = 0; j < k; j++) {
+    first->v[j] = m->v[first->col_for_row[j]];
+  }
+  murty_unload(m, first);
+  first->weight = murty_weight(m, first);
+
+  return 1;
+}
+
+void
+murty_free(murty_t *m)
+{
+  for (int i = 0; i < m->num_solved; i++) {
+    assignment_free(&m->solved[i]);
+  }
+  assignment_free(&m->scratch);
+  safe_free(m->solved);
+  safe_free(m->heap);
+  safe_free(m->cost);
+  safe_free(m->forbid);
+  safe_free(m->locked);
+  safe_free(m->row_for_col);
+  safe_free(m->v);
+  safe_free(m->dist);
+  safe_free(m->path);
+  safe_free(m->remaining);
+  safe_free(m->row_seen);
+  safe_free(m->col_seen);
+}
+
+int
+murty_candidate(int row, int col)
+{
+  // each slot's candidates are sorted by person_id
+  //
+  int lo = sched->slot_offsets[row];
+  int hi = sched->slot_offsets[row + 1] - 1;
+
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    int id = sched->candidate_ids[mid];
+
+    if (id == col) {
+      return mid;
+    } else if (id < col) {
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  return -1;
+}
+
+float
+murty_weight(const murty_t *m, const assignment_t *a)
+{
+  float weight = 0;
+
+  for (int j = 0; j < m->k; j++) {
+    weight += sched->candidate_weights[murty_candidate(j, a->col_for_row[j])];
+  }
+
+  return weight;
+}
+
+void
+murty_load(murty_t *m, const assignment_t *a)
+{
+  // a solved assignment keeps only the duals of its matched columns;
+  // every other column is unmatched with a zero dual
+  //
+  for (int j = 0; j < m->k; j++) {
+    int col = a->col_for_row[j];
+
+    if (col >= 0) {
+      m->row_for_col[col] = j;
+      m->v[col] = a->v[j];
+    }
+  }
+}
+
+void
+murty_unload(murty_t *m, const assignment_t *a)
+{
+  for (int j = 0; j < m->k; j++) {
+    int col = a->col_for_row[j];
+
+    if (col >= 0) {
+      m->row_for_col[col] = -1;
+      m->v[col] = 0;
+    }
+  }
+}
+
+int
+murty_augment(murty_t *m, assignment_t *a, int row, int target)
+{
+  // shortest augmenting path from an unmatched row on reduced costs.
+  // the duals of the matching stay feasible when an edge is excluded
+  // or a row is unmatched, so one path re-solves a partition.
+  //
+  // unmatched people all carry a zero dual and are reached as one, through
+  // the closest of them.  the first assignment ends its paths there.  a
+  // partition ends its path at the column it freed ('target'); passing
+  // through the unmatched people on the way hands one held column back
+  // to them.
+  //
+  int i = row;
+  int sink = -1;
+  int num_remaining = 0;
+  int free_col = -1;   // closest unmatched person
+  int free_row = -1;   // row it is reached from
+  int via_free = 0;    // whether the path went through the unmatched people
+  double free_dist = MURTY_INFINITY;
+  double min_val = 0;
+
+  stats.assignments++;
+
+  // only the columns held by unforced rows, and the freed column, are
+  // searched one by one
+  //
+  for (int r = 0; r < m->k; r++) {
+    m->row_seen[r] = 0;
+    if (!a->forced[r] && a->col_for_row[r] >= 0) {
+      m->remaining[num_remaining++] = a->col_for_row[r];
+    }
+  }
+  if (target >= 0) {
+    m->remaining[num_remaining++] = target;
+  }
+  for (int it = 0; it < num_remaining; it++) {
+    int j = m->remaining[it];
+    m->dist[j] = MURTY_INFINITY;
+    m->col_seen[j] = 0;
+  }
+
+  while (sink == -1) {
+    int index = -1;
+    double lowest = MURTY_INFINITY;
+
+    if (i >= 0) {
+      m->row_seen[i] = 1;
+
+      for (int c = sched->slot_offsets[i]; c < sched->slot_offsets[i + 1]; c++) {
+        int j = sched->candidate_ids[c];
+        double r = min_val + m->cost[c] - a->u[i] - m->v[j];
+
+        if (m->locked[j] || m->forbid[c]) {
+          continue;
+        }
+
+        if (m->row_for_col[j] == -1 && j != target) {
+          if (!via_free &&
+              (r < free_dist || (r == free_dist && j < free_col))) {
+            free_dist = r;
+            free_col = j;
+            free_row = i;
+          }
+        } else if (!m->col_seen[j] && r < m->dist[j]) {
+          m->path[j] = i;
+          m->dist[j] = r;
+        }
+      }
+    }
+
+    // closest column first, then the column the path has to end at,
+    // then lower ids
+    //
+    for (int it = 0; it < num_remaining; it++) {
+      int j = m->remaining[it];
+
+      if (index < 0 || m->dist[j] < lowest) {
+        lowest = m->dist[j];
+        index = it;
+      } else if (m->dist[j] == lowest) {
+        int best = m->remaining[index];
+
+        if (j == target || (best != target && j < best)) {
+          index = it;
+        }
+      }
+    }
+
+    if (!via_free && free_col >= 0 &&
+        (index < 0 || free_dist < lowest ||
+         (free_dist == lowest &&
+          (target < 0 || (m->remaining[index] != target &&
+                          free_col < m->remaining[index]))))) {
+      min_val = free_dist;
+      via_free = 1;
+      m->path[free_col] = free_row;
+      i = -1;
+
+      if (target < 0) {
+        sink = free_col;
+        break;
+      }
+
+      // any held column can now be handed to the unmatched people
+      //
+      for (int it = 0; it < num_remaining; it++) {
+        int j = m->remaining[it];
+        double r = free_dist - m->v[j];
+
+        if (r < m->dist[j]) {
+          m->path[j] = -1;
+          m->dist[j] = r;
+        }
+      }
+      continue;
+    }
+
+    if (index < 0 || lowest == MURTY_INFINITY) {
+      return 0;
+    }
+
+    int j = m->remaining[index];
+
+    min_val = lowest;
+    m->col_seen[j] = 1;
+    m->remaining[index] = m->remaining[--num_remaining];
+
+    if (j == target) {
+      sink = j;
+    } else {
+      i = m->row_for_col[j];
+    }
+  }
+
+  // update the duals.  after going through the unmatched people, every
+  // dual is shifted so theirs stay at zero.
+  //
+  a->u[row] += min_val;
+  for (int r = 0; r < m->k; r++) {
+    if (m->row_seen[r] && r != row) {
+      int col = a->col_for_row[r];
+      a->u[r] += min_val - m->dist[col];
+      m->v[col] -= min_val - m->dist[col];
+    }
+  }
+
+  if (via_free && target >= 0 && min_val > free_dist) {
+    double shift = min_val - free_dist;
+
+    for (int r = 0; r < m->k; r++) {
+      a->u[r] -= shift;
+      if (a->col_for_row[r] >= 0) {
+        m->v[a->col_for_row[r]] += shift;
+      }
+    }
+    m->v[target] += shift;
+  }
+
+  // then flip the matching along the path
+  //
+  for (int j = sink;;) {
+    int r = m->path[j];
+
+    if (r < 0) {
+      m->row_for_col[j] = -1;
+      m->v[j] = 0;
+      j = free_col;
+      r = m->path[j];
+    }
+
+    int next = a->col_for_row[r];
+
+    m->row_for_col[j] = r;
+    a->col_for_row[r] = j;
+    j = next;
+
+    if (r == row) {
+      break;
+    }
+  }
+
+  return 1;
+}
+
+int
+murty_partition(murty_t *m, int parent, int index, assignment_t *a)
+{
+  // partition 'index' of a solved assignment keeps its first 'index'
+  // free slots, and excludes its person from the next free slot
+  //
+  const assignment_t *from = &m->solved[parent];
+  int ok = 0;
+  int row = -1;
+  int seen = 0;
+
+  assignment_copy(a, from, m->k);
+
+  for (int j = 0; j < m->k && row < 0; j++) {
+    if (a->forced[j]) {
+      continue;
+    }
+    if (seen++ == index) {
+      row = j;
+    } else {
+      a->forced[j] = 1;
+    }
+  }
+
+  if (row < 0) {
+    return 0;
+  }
+
+  murty_load(m, a);
+
+  a->parent = parent;
+  a->forbid_row = row;
+  a->forbid_col = a->col_for_row[row];
+  a->forbid_cand = murty_candidate(row, a->forbid_col);
+  m->row_for_col[a->forbid_col] = -1;
+  a->col_for_row[row] = -1;
+
+  // every exclusion on the way back to the first assignment still holds
+  //
+  m->forbid[a->forbid_cand] = 1;
+  for (int p = parent; p >= 0 && m->solved[p].forbid_row >= 0; p = m->solved[p].parent) {
+    m->forbid[m->solved[p].forbid_cand] = 1;
+  }
+  for (int j = 0; j < m->k; j++) {
+    if (a->forced[j]) {
+      m->locked[a->col_for_row[j]] = 1;
+    }
+  }
+
+  ok = murty_augment(m, a, row, a->forbid_col);
+
+  m->forbid[a->forbid_cand] = 0;
+  for (int p = parent; p >= 0 && m->solved[p].forbid_row >= 0; p = m->solved[p].parent) {
+    m->forbid[m->solved[p].forbid_cand] = 0;
+  }
+  for (int j = 0; j < m->k; j++) {
+    if (a->forced[j]) {
+      m->locked[a->col_for_row[j]] = 0;
+    }
+  }
+
+  if (ok) {
+    for (int j = 0; j < m->k; j++) {
+      a->v[j] = m->v[a->col_for_row[j]];
+    }
+    a->weight = murty_weight(m, a);
+  }
+
+  // leave every column unmatched for the next partition; the parent's
+  // columns cover the freed one and any handed back
+  //
+  murty_unload(m, from);
+  murty_unload(m, a);
+
+  return ok;
+}
+
+int
+murty_push(murty_t *m, float weight, int parent, int index)
+{
+  int i = m->heap_size;
+
+  if (m->heap_size == m->heap_capacity) {
+    int capacity = m->heap_capacity ? m->heap_capacity * 2 : 64;
+    murty_entry_t *heap = realloc(m->heap, capacity * sizeof(murty_entry_t));
+
+    if (!heap) {
+      return 0;
+    }
+    m->heap = heap;
+    m->heap_capacity = capacity;
+  }
+  m->heap_size++;
+
+  m->heap[i].weight = weight;
+  m->heap[i].parent = parent;
+  m->heap[i].index = index;
+  m->heap[i].seq = m->seq++;
+
+  // sift up, heaviest first and oldest first among equal weights
+  //
+  while (i > 0) {
+    int up = (i - 1) / 2;
+    murty_entry_t t;
+
+    if (m->heap[up].weight > m->heap[i].weight ||
+        (m->heap[up].weight == m->heap[i].weight &&
+         m->heap[up].seq < m->heap[i].seq)) {
+      break;
+    }
+
+    t = m->heap[up];
+    m->heap[up] = m->heap[i];
+    m->heap[i] = t;
+    i = up;
+  }
+
+  return 1;
+}
+
+int
+murty_pop(murty_t *m, murty_entry_t *e)
+{
+  int i = 0;
+
+  if (m->heap_size == 0) {
+    return 0;
+  }
+
+  *e = m->heap[0];
+  m->heap[0] = m->heap[--m->heap_size];
+
+  for (;;) {
+    int best = i;
+    int l = 2 * i + 1;
+    int r = 2 * i + 2;
+    murty_entry_t t;
+
+    for (int c = l; c <= r && c < m->heap_size; c++) {
+      if (m->heap[c].weight > m->heap[best].weight ||
+          (m->heap[c].weight == m->heap[best].weight &&
+           m->heap[c].seq < m->heap[best].seq)) {
+        best = c;
+      }
+    }
+
+    if (best == i) {
+      break;
+    }
+
+    t = m->heap[best];
+    m->heap[best] = m->heap[i];
+    m->heap[i] = t;
+    i = best;
+  }
+
+  return 1;
+}
+
+void
+murty_emit(murty_t *m, const assignment_t *a)
+{
+  node_t *list = owned_list_new();
+
+  for (int j = 0; j < m->k; j++) {
+    list[j].person_id = a->col_for_row[j];
+    list[j].weight =
+      sched->candidate_weights[murty_candidate(j, a->col_for_row[j])];
+  }
+
+  incumbent_set[incumbent_count].node_list = list;
+  incumbent_set[incumbent_count].total_weight = a->weight;
+  TRACE(TRACE_LEVEL_SEARCH, TRACE_INCUMBENT, TRACE_REASON_NONE,
+        m->k, -1, a->weight, incumbent_count);
+  incumbent_count++;
+}
+
+int
+murty_search(void)
+{
+  // Murty's ranking: hand out the best assignment, split the rest of
+  // its partition into one subproblem per free slot, and repeat with
+  // the best subproblem.  a subproblem is solved to get its weight,
+  // and solved again from its parent only once it is handed out.
+  //
+  // returns 0 when the tables could not be allocated, with the
+  // incumbents left as they were, so the caller searches the tree.
+  //
+  murty_t m;
+  murty_entry_t e;
+  int last = 0;
+  int ok = 1;
+  float initial = incumbent_get_last_weight();
+  int status = murty_init(&m);
+
+  if (status <= 0) {
+    murty_free(&m);
+    return status == 0;
+  }
+
+  while (incumbent_count < num_requested_solutions &&
+         m.solved[last].weight > incumbent_get_last_weight()) {
+    assignment_t *solved = NULL;
+
+    murty_emit(&m, &m.solved[last]);
+
+    if (incumbent_count == num_requested_solutions) {
+      break;
+    }
+
+    for (int i = 0; i < m.k && ok; i++) {
+      if (murty_partition(&m, last, i, &m.scratch)) {
+        ok = murty_push(&m, m.scratch.weight, last, i);
+      }
+    }
+
+    if (!ok || !murty_pop(&m, &e)) {
+      break;
+    }
+
+    solved = realloc(m.solved, (m.num_solved + 1) * sizeof(assignment_t));
+    if (!solved) {
+      ok = 0;
+      break;
+    }
+    m.solved = solved;
+    last = m.num_solved++;
+    if (!assignment_alloc(&m.solved[last], m.k)) {
+      ok = 0;
+      break;
+    }
+    murty_partition(&m, e.parent, e.index, &m.solved[last]);
+  }
+
+  murty_free(&m);
+
+  if (!ok) {
+    for (int i = 0; i < num_requested_solutions; i++) {
+      incumbent_set[i].node_list = NULL;
+      incumbent_set[i].total_weight = initial;
+    }
+    incumbent_count = 0;
+  }
+
+  return ok;
+}
+
+int
+schedule_solve(schedule_t *s, int num_solutions, result_t *r)
+{
+  solution_t *root = NULL;
+  small_arena_t *small = NULL;
+  schedule_t *searched = NULL;
+  int ranked = 0;
+  presolve_t pre;
+
+  sched = s;
+  num_requested_solutions = num_solutions;
+  memset(&stats, 0, sizeof(solve_stats_t));
+  memset(&pre, 0, sizeof(presolve_t));
+  trace_begin();
+  TRACE(TRACE_LEVEL_SEARCH, TRACE_SOLVE, TRACE_REASON_BEGIN,
+        s->num_slots, -1, 0, s->num_people);
+
+  // shrink the problem first, and run the search on the reduced
+  // schedule if anything could be removed
+  //
+  if (sched->presolve) {
+    presolve_run(&pre, num_requested_solutions);
+    if (pre.reduced) {
+      sched = pre.reduced;
+    }
+  }
+
+  // initialize the bb proces.  forced slots already carry some weight,
+  // so the incumbent floor is lowered by that much to keep the same
+  // acceptance threshold as the full problem.
+  //
+  num_expanded_solutions = 0;
+  incumbent_set = calloc(num_requested_solutions, sizeof(solution_t));
+  for (int i = 0; i < num_requested_solutions; i++) {
+    incumbent_set[i].total_weight = -pre.fixed_weight;
+  }
+  incumbent_count = 0;
+  schedule_build_candidates();
+  stats.root_bound = root_bound() + pre.fixed_weight;
+
+  // rank assignments directly when nothing ties the slots together,
+  // otherwise run the branching algorithm
+  //
+#ifndef BRANCHY_NO_MURTY
+  if (murty_fits()) {
+    ranked = murty_search();
+  }
+#endif
+
+  // only the branching searches read the cache
+  //
+  if (!ranked) {
+    cache_init(sched->cache_bytes);
+  }
+
+#ifndef BRANCHY_NO_SMALL_KERNELS
+  if (!ranked && small_kernel_fits()) {
+    small = small_arena_get();
+    small_search(small);
+  }
+#endif
+
+  if (!ranked && !small) {
+    create_root(&root);
+
+    if (sched->search_mode == SEARCH_BEAM) {
+      beam_search(root);
+    } else if (sched->search_mode == SEARCH_DISCREPANCY) {
+      discrepancy_expand(root, 0, sched->search_limit);
+    } else {
+      expand_branch(root, 0);
+    }
+  }
+  cache_free();
+
+  TRACE(TRACE_LEVEL_SEARCH, TRACE_SOLVE, TRACE_REASON_END,
+        sched->num_slots, -1,
+        incumbent_count ? incumbent_set[0].total_weight : 0,
+        num_expanded_solutions);
+
+  stats.expanded = num_expanded_solutions;
+  searched = sched;
+  sched = s;
+  incumbent_export(r, &pre);
+
+  // a heuristic result is only known to be within 'gap' of the optimum
+  //
+  stats.gap = (r->count > 0) ? stats.root_bound - r->total_weights[0] : NAN;
+
+  if (root) {
+    sched = searched;
+    free_branch(root);
+    safe_free(root);
+    sched = s;
+  }
+  owned_lists_free();
+  safe_free(incumbent_set);
+  presolve_free(&pre);
+
+  return r->count;
+}
+
+void *
+batch_worker(void *arg)
+{
+  batch_t *b = (batch_t *)arg;
+  int i = 0;
+
+  // threads pull the next unsolved instance until none are left, so
+  // uneven instances still keep every thread busy.  an instance only
+  // counts as solved when the batch was not cancelled under it.
+  //
+  cancel = &b->cancelled;
+  while (!b->cancelled &&
+         (i = __sync_fetch_and_add(&b->next, 1)) < b->count) {
+    if (b->completed[i]) {
+      continue;
+    }
+    result_free(&b->results[i]);
+    schedule_solve(b->schedules[i], b->num_solutions[i], &b->results[i]);
+    if (!b->cancelled) {
+      b->completed[i] = 1;
+    }
+  }
+  cancel = NULL;
+
+  return NULL;
+}
+
+void *
+pool_thread(void *arg)
+{
+  uint64_t seen = 0;
+
+  // pool threads live as long as the process and keep their search
+  // state (small kernel arena, trace ring) from batch to batch
+  //
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    batch_t *b = NULL;
+
+    while (pool.generation == seen && !pool.stopping) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    if (pool.stopping) {
+      break;
+    }
+    seen = pool.generation;
+    b = pool.batch;
+    pthread_mutex_unlock(&pool.lock);
+
+    batch_worker(b);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.busy == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  return NULL;
+}
+
+void
+pool_stop(ruby_vm_t *vm)
+{
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void
+pool_atfork_child(void)
+{
+  // only the forking thread survives in the child, so start over
+  //
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_mutex_init(&pool.running, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pool.started = 0;
+  pool.size = 0;
+  pool.busy = 0;
+  pool.batch = NULL;
+}
+
+int
+pool_start(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t thread;
+
+  // one thread per core besides the caller, started on first use.  a
+  // thread that fails to start just leaves more work for the others.
+  //
+  if (pool.started) {
+    return pool.size;
+  }
+  pool.started = 1;
+
+  if (!pool.atfork) {
+    pthread_atfork(NULL, NULL, pool_atfork_child);
+    pool.atfork = 1;
+  }
+
+  for (long i = 1; i < cpus; i++) {
+    if (pthread_create(&thread, NULL, pool_thread, NULL) == 0) {
+      pthread_detach(thread);
+      pool.size++;
+    }
+  }
+
+  return pool.size;
+}
+
+void *
+batch_run(void *arg)
+{
+  batch_t *b = (batch_t *)arg;
+  int posted = 0;
+
+  // the calling thread works through the batch alongside the pool.  a
+  // batch from another Ruby thread that finds the pool in use is solved
+  // on its calling thread alone rather than waiting.
+  //
+  if (b->count > 1 && pthread_mutex_trylock(&pool.running) == 0) {
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.stopping && pool_start() > 0) {
+      pool.batch = b;
+      pool.busy = pool.size;
+      pool.generation++;
+      pthread_cond_broadcast(&pool.work);
+      posted = 1;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!posted) {
+      pthread_mutex_unlock(&pool.running);
+    }
+  }
+
+  batch_worker(b);
+
+  if (posted) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.batch = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.running);
+  }
+
+  return NULL;
+}
+
+void
+batch_interrupt(void *arg)
+{
+  // Ruby wants the calling thread back: the searches running on the
+  // batch stop at their next branch, and nothing new is handed out
+  //
+  batch_t *b = (batch_t *)arg;
+
+  b->cancelled = 1;
+  __sync_synchronize();
+}
+
+/*----------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------------*/
+
+
+// Defining a space for information and references about the module to
+// be stored internally
+//
+VALUE cBranchy = Qnil;
+
+// Prototype for the initialization method - Ruby calls this, not you
+//
+void Init_branchy();
+
+// schedule methods
+//
+VALUE method_schedule_create(VALUE self, VALUE number_of_slots);
+VALUE method_schedule_free(VALUE self);
+VALUE method_schedule_print(VALUE self);
+VALUE method_schedule_set_weight(VALUE self, VALUE weights, VALUE attribute_ids);
+VALUE method_schedule_set_sparse_weight(VALUE self, VALUE weights, VALUE attribute_ids);
+VALUE method_schedule_set_constraints(VALUE self, VALUE constraints);
+VALUE method_schedule_compute_solution(VALUE self, 
+                                       VALUE number_of_solutions_to_find,
+                                       VALUE returned_weights_hash);
+VALUE method_schedule_compute_packed(VALUE self,
+                                     VALUE number_of_solutions_to_find);
+VALUE method_schedule_set_presolve(VALUE self, VALUE enabled);
+VALUE method_schedule_set_cache(VALUE self, VALUE max_bytes);
+VALUE method_schedule_set_search(VALUE self, VALUE mode, VALUE limit);
+VALUE method_schedule_stats(VALUE self);
+VALUE method_schedule_set_trace(VALUE self, VALUE level, VALUE max_events);
+VALUE method_schedule_trace_json(VALUE self);
+VALUE method_schedule_compute_batch(VALUE self,
+                                    VALUE instances,
+                                    VALUE returned_weights_array);
+
+// schedule helpers
+//
+int schedule_add_person(schedule_t *s, VALUE attribute_ids);
+int schedule_add_weight(schedule_t *s, VALUE weights, VALUE attribute_ids);
+int schedule_add_sparse_weight(schedule_t *s, VALUE weights, VALUE attribute_ids);
+int schedule_add_packed_weights(schedule_t *s, VALUE packed, VALUE attributes);
+int schedule_add_constraint(schedule_t *s, VALUE constraint_ids);
+int requested_solution_count(VALUE number_of_solutions);
+long requested_cache_bytes(VALUE max_bytes);
+void schedule_apply_search(schedule_t *s, VALUE mode, VALUE limit);
+int schedule_compute(int num_solutions, result_t *r);
+VALUE solution_hash(const result_t *r, VALUE returned_weights_hash);
+VALUE solution_packed(const result_t *r);
+VALUE batch_option(VALUE instance, const char *name);
+int batch_completed(const batch_t *b);
+VALUE batch_call(VALUE arg);
+VALUE batch_cleanup(VALUE arg);
+
+
+// The initialization method for this module
+//
+void Init_branchy() {
+  cBranchy = rb_define_module("Branchy");
+  rb_define_method(cBranchy, "schedule_create", method_schedule_create, 1);
+  rb_define_method(cBranchy, "schedule_free", method_schedule_free, 0);
+  rb_define_method(cBranchy, "schedule_print", method_schedule_print, 0);
+  rb_define_method(cBranchy, "schedule_set_weight", method_schedule_set_weight, 2);
+  rb_define_method(cBranchy, "schedule_set_sparse_weight", method_schedule_set_sparse_weight, 2);
+  rb_define_method(cBranchy, "schedule_set_constraints", method_schedule_set_constraints, 1);
+  rb_define_method(cBranchy, "schedule_compute_solution", method_schedule_compute_solution, 2);
+  rb_define_method(cBranchy, "schedule_compute_packed", method_schedule_compute_packed, 1);
+  rb_define_method(cBranchy, "schedule_set_presolve", method_schedule_set_presolve, 1);
+  rb_define_method(cBranchy, "schedule_set_cache", method_schedule_set_cache, 1);
+  rb_define_method(cBranchy, "schedule_set_search", method_schedule_set_search, 2);
+  rb_define_method(cBranchy, "schedule_stats", method_schedule_stats, 0);
+  rb_define_method(cBranchy, "schedule_set_trace", method_schedule_set_trace, 2);
+  rb_define_method(cBranchy, "schedule_trace_json", method_schedule_trace_json, 0);
+  rb_define_method(cBranchy, "schedule_compute_batch", method_schedule_compute_batch, 2);
+
+  ruby_vm_at_exit(pool_stop);
+}
+
+VALUE method_schedule_create(VALUE self, VALUE number_of_slots) {
+  Check_Type(number_of_slots, T_FIXNUM);
+  schedule = schedule_new(NUM2INT(number_of_slots));
+  return Qnil;
+}
+
+VALUE method_schedule_free(VALUE self)
+{
+  if (schedule) {
+    schedule_destroy(schedule);
+    schedule = NULL;
+  }
+  return Qnil;
+}
+
+VALUE method_schedule_print(VALUE self)
 {
   // Current Schedule:
   //
@@ -650,110 +3435,293 @@ VALUE method_schedule_print(VALUE self)
   // 00      1.222 1.133 2.111 0.111      1 3 5 7 9
   // 00      1.222 1.133 2.111 0.111      1 3 5 7
   // 00      1.222 1.133 2.111            1
+  // 00      1.222   -     -   0.111      1 3
   //
   // constraint    values
   // =====================
   // 0           1 3 4 5 9
   //
 
-  if (!sched) {
-    printf("Current schedule is empty.\n");
-    return self;
+  if (!schedule) {
+    printf("Current schedule is empty.\n");
+    return self;
+  }
+
+  sched = schedule;
+
+  printf("Current schedule:\n\n");
+
+  printf("person  weights                      attribs\n");
+  printf("==============================================\n");
+  for (int i = 0; i < sched->num_people; i++) {
+    printf("%2d", i);
+    printf("%6s", "");
+    for (int j = 0; j < sched->num_slots; j++) {
+      float w = schedule_weight(i, j);
+      if (w == SLOT_WEIGHT_INELIGIBLE) {
+        printf("%3s%3s", "-", "");
+      } else {
+        printf("%1.3f ", w);
+      }
+    }
+    printf("%6s", "");
+    for (int j = 0; j < sched->attribs[i]->num_values; j++) {
+      printf("%2d ", sched->attribs[i]->values[j]);
+    }
+    printf("\n");
+  }
+
+  printf("\n");
+
+  printf("constraint    values\n");
+  printf("======================\n");
+  for (int i = 0; i < sched->num_constraints; i++) {
+    printf("%2d", i);
+    printf("%6s", "");
+    for (int j = 0; j < sched->constraints[i]->num_values; j++) {
+      printf("%2d ", sched->constraints[i]->values[j]);
+    }
+    printf("\n");
+  }
+
+  return self;
+}
+
+
+
+int schedule_add_person(schedule_t *s, VALUE attribute_ids)
+{
+  int index = s->num_people;
+
+  // add one new weights structure and one new attributes structure
+  // to the schedule to track the entity.  the caller fills in either
+  // the dense or the sparse weights.
+  //
+  s->num_people += 1;
+  s->weights =
+    realloc(s->weights, s->num_people * sizeof(s->weights));
+  s->weights[index] = NULL;
+  s->sparse =
+    realloc(s->sparse, s->num_people * sizeof(s->sparse));
+  s->sparse[index] = NULL;
+  s->attribs =
+    realloc(s->attribs, s->num_people * sizeof(s->attribs));
+  s->attribs[index] = calloc(1, sizeof(context_t));
+  s->candidates_valid = 0;
+
+  // allocate the fields inside the new attributes structure
+  //
+  s->attribs[index]->values = calloc(RARRAY_LEN(attribute_ids), sizeof(uint));
+  s->attribs[index]->num_values = (uint)RARRAY_LEN(attribute_ids);
+
+  uint num_attribs = s->attribs[index]->num_values;
+  int *attribs = s->attribs[index]->values;
+
+  // update the attribute values with the caller's data
+  //
+  for (uint i = 0; i < num_attribs; i++) {
+    attribs[i] = NUM2INT((RARRAY_PTR(attribute_ids))[i]);
+  }
+
+  return index;
+}
+
+int schedule_add_weight(schedule_t *s, VALUE weights, VALUE attribute_ids)
+{
+  int index = 0;
+
+  Check_Type(weights, T_ARRAY);
+  Check_Type(attribute_ids, T_ARRAY);
+
+  if (RARRAY_LEN(weights) != s->num_slots ||
+      RARRAY_LEN(weights) == 0) {
+    return 0;
+  }
+
+  index = schedule_add_person(s, attribute_ids);
+  s->weights[index] = calloc(s->num_slots, sizeof(float));
+
+  // update the schedule weights with the caller's data
+  //
+  for (int i = 0; i < s->num_slots; i++) {
+    (s->weights)[index][i] = NUM2DBL((RARRAY_PTR(weights))[i]);
+  }
+
+  return 1;
+}
+
+int schedule_add_sparse_weight(schedule_t *s, VALUE weights, VALUE attribute_ids)
+{
+  int index = 0;
+  VALUE pairs = Qnil;
+  sparse_row_t *row = NULL;
+
+  Check_Type(weights, T_HASH);
+  Check_Type(attribute_ids, T_ARRAY);
+
+  if (RHASH_SIZE(weights) == 0) {
+    return 0;
+  }
+
+  // weights come in as { slot_id => weight } for the slots the entity
+  // is eligible for; every other slot is left out entirely
+  //
+  pairs = rb_funcall(weights, rb_intern("to_a"), 0);
+
+  for (long i = 0; i < RARRAY_LEN(pairs); i++) {
+    VALUE key = RARRAY_PTR(RARRAY_PTR(pairs)[i])[0];
+    int slot_id = 0;
+
+    Check_Type(key, T_FIXNUM);
+    slot_id = NUM2INT(key);
+    if (slot_id < 0 || slot_id >= s->num_slots) {
+      return 0;
+    }
+  }
+
+  row = calloc(1, sizeof(sparse_row_t));
+  row->num_values = (uint)RARRAY_LEN(pairs);
+  row->slots = calloc(row->num_values, sizeof(int));
+  row->weights = calloc(row->num_values, sizeof(float));
+
+  // keep the row sorted by slot id (rows are tiny, insertion sort)
+  //
+  for (uint i = 0; i < row->num_values; i++) {
+    VALUE pair = RARRAY_PTR(pairs)[i];
+    int slot_id = NUM2INT(RARRAY_PTR(pair)[0]);
+    float w = NUM2DBL(RARRAY_PTR(pair)[1]);
+    uint j = i;
+
+    while (j > 0 && row->slots[j - 1] > slot_id) {
+      row->slots[j] = row->slots[j - 1];
+      row->weights[j] = row->weights[j - 1];
+      j--;
+    }
+
+    row->slots[j] = slot_id;
+    row->weights[j] = w;
+  }
+
+  // a slot may only be given once
+  //
+  for (uint i = 1; i < row->num_values; i++) {
+    if (row->slots[i] == row->slots[i - 1]) {
+      safe_free(row->slots);
+      safe_free(row->weights);
+      safe_free(row);
+      return 0;
+    }
+  }
+
+  index = schedule_add_person(s, attribute_ids);
+  s->sparse[index] = row;
+
+  return 1;
+}
+
+int schedule_add_packed_weights(schedule_t *s, VALUE packed, VALUE attributes)
+{
+  long row_bytes = s->num_slots * (long)sizeof(float);
+  long people = 0;
+  const char *data = NULL;
+  VALUE none = rb_ary_new();
+
+  // a String of native floats, num_slots per entity, as produced by
+  // Array#pack('f*').  ineligible slots use -Float::MAX.
+  //
+  Check_Type(packed, T_STRING);
+
+  if (row_bytes == 0 ||
+      RSTRING_LEN(packed) == 0 ||
+      RSTRING_LEN(packed) % row_bytes != 0) {
+    return 0;
   }
 
-  printf("Current schedule:\n\n");
+  people = RSTRING_LEN(packed) / row_bytes;
 
-  printf("person  weights                      attribs\n");
-  printf("==============================================\n");
-  for (int i = 0; i < sched->num_people; i++) {
-    printf("%2d", i);
-    printf("%6s", "");
-    for (int j = 0; j < sched->num_slots; j++) {
-      printf("%1.3f ", sched->weights[i][j]);
-    }
-    printf("%6s", "");
-    for (int j = 0; j < sched->attribs[i]->num_values; j++) {
-      printf("%2d ", sched->attribs[i]->values[j]);
+  if (!NIL_P(attributes)) {
+    Check_Type(attributes, T_ARRAY);
+    if (RARRAY_LEN(attributes) != people) {
+      return 0;
     }
-    printf("\n");
   }
 
-  printf("\n");
+  for (long i = 0; i < people; i++) {
+    VALUE attribute_ids = NIL_P(attributes) ? none : RARRAY_PTR(attributes)[i];
+    int index = 0;
 
-  printf("constraint    values\n");
-  printf("======================\n");
-  for (int i = 0; i < sched->num_constraints; i++) {
-    printf("%2d", i);
-    printf("%6s", "");
-    for (int j = 0; j < sched->constraints[i]->num_values; j++) {
-      printf("%2d ", sched->constraints[i]->values[j]);
-    }
-    printf("\n");
+    Check_Type(attribute_ids, T_ARRAY);
+    index = schedule_add_person(s, attribute_ids);
+    s->weights[index] = calloc(s->num_slots, sizeof(float));
+
+    // the string may move if Ruby code runs, so fetch it every row
+    //
+    data = RSTRING_PTR(packed);
+    memcpy(s->weights[index], data + i * row_bytes, row_bytes);
   }
 
-  return self;
+  return 1;
 }
 
-
-
-VALUE method_schedule_set_weight(VALUE self, VALUE weights, VALUE attribute_ids)
+int schedule_add_constraint(schedule_t *s, VALUE constraint_ids)
 {
   int index = 0;
 
-  Check_Type(weights, T_ARRAY);
-  Check_Type(attribute_ids, T_ARRAY);
+  Check_Type(constraint_ids, T_ARRAY);
 
-  if (sched) {
+  if (RARRAY_LEN(constraint_ids) == 0) {
+    return 0;
+  }
 
-    if (RARRAY_LEN(weights) != sched->num_slots ||
-        RARRAY_LEN(weights) == 0 ||
-        RARRAY_LEN(attribute_ids) == 0) {
-      return Qfalse;
-    }
+  index = s->num_constraints;
 
-    index = sched->num_people;
+  // add one new constraints structure to the schedule
+  // for this new set of constraints
+  //
+  s->num_constraints += 1;
+  s->constraints =
+    realloc(s->constraints, s->num_constraints * sizeof(s->constraints));
+  s->constraints[index] = calloc(1, sizeof(context_t));
 
-    // add one new weights structure to the schedule to track the
-    // entity's weights
-    //
-    sched->num_people += 1;
-    sched->weights =
-      realloc(sched->weights, sched->num_people * sizeof(sched->weights));
-    sched->weights[index] = calloc(sched->num_slots, sizeof(float));
+  // allocate the fields inside the new constraints structure
+  //
+  s->constraints[index]->values = calloc(RARRAY_LEN(constraint_ids), sizeof(uint));
+  s->constraints[index]->num_values = (uint)RARRAY_LEN(constraint_ids);
 
-    // update the schedule weights with the caller's data
-    //
-    for (int i = 0; i < sched->num_slots; i++) {
-      (sched->weights)[index][i] = NUM2DBL((RARRAY_PTR(weights))[i]);
-      if (debug) {
-        printf("Added weight %1.3f\n", (sched->weights)[index][i]);
-      }
-    }
+  uint num_attribs = s->constraints[index]->num_values;
+  int *attribs = s->constraints[index]->values;
 
-    // add one new attributes structure to the schedule to track the
-    // entity's attributes
-    //
-    sched->attribs =
-      realloc(sched->attribs, sched->num_people * sizeof(sched->attribs));
-    sched->attribs[index] = calloc(1, sizeof(context_t));
+  // update the constraints fields with the caller's data
+  //
+  for (uint i = 0; i < num_attribs; i++) {
+    attribs[i] = NUM2INT((RARRAY_PTR(constraint_ids))[i]);
+  }
 
-    // allocate the fields inside the new attributes structure
-    //
-    sched->attribs[index]->values = calloc(RARRAY_LEN(attribute_ids), sizeof(uint));
-    sched->attribs[index]->num_values = (uint)RARRAY_LEN(attribute_ids);
+  return 1;
+}
 
-    uint num_attribs = sched->attribs[index]->num_values;
-    int *attribs = sched->attribs[index]->values;
+VALUE method_schedule_set_weight(VALUE self, VALUE weights, VALUE attribute_ids)
+{
+  Check_Type(weights, T_ARRAY);
+  Check_Type(attribute_ids, T_ARRAY);
 
-    // update the attribute values with the caller's data
-    //
-    for (uint i = 0; i < num_attribs; i++) {
-      attribs[i] = NUM2INT((RARRAY_PTR(attribute_ids))[i]);
-      if (debug) {
-        printf("Added attribute %d\n", attribs[i]);
-      }
-    }
+  if (schedule &&
+      RARRAY_LEN(attribute_ids) > 0 &&
+      schedule_add_weight(schedule, weights, attribute_ids)) {
+    return Qtrue;
+  }
+
+  return Qfalse;
+}
 
+VALUE method_schedule_set_sparse_weight(VALUE self, VALUE weights, VALUE attribute_ids)
+{
+  Check_Type(weights, T_HASH);
+  Check_Type(attribute_ids, T_ARRAY);
+
+  if (schedule &&
+      RARRAY_LEN(attribute_ids) > 0 &&
+      schedule_add_sparse_weight(schedule, weights, attribute_ids)) {
     return Qtrue;
   }
 
@@ -762,113 +3730,494 @@ VALUE method_schedule_set_weight(VALUE self, VALUE weights, VALUE attribute_ids)
 
 VALUE method_schedule_set_constraints(VALUE self, VALUE constraint_ids)
 {
-  int index = 0;
-
   Check_Type(constraint_ids, T_ARRAY);
 
-  if (sched) {
-    if (RARRAY_LEN(constraint_ids) == 0) {
-      return Qfalse;
+  if (schedule &&
+      schedule_add_constraint(schedule, constraint_ids)) {
+    return Qtrue;
+  }
+
+  return Qfalse;
+}
+
+int requested_solution_count(VALUE number_of_solutions)
+{
+  int n = NUM2INT(number_of_solutions);
+
+  if (n < 1) {
+    rb_raise(rb_eRangeError, "number of solutions must be at least 1");
+  }
+
+  return n;
+}
+
+long requested_cache_bytes(VALUE max_bytes)
+{
+  long n = NUM2LONG(max_bytes);
+
+  if (n < 0) {
+    rb_raise(rb_eRangeError, "cache size must not be negative");
+  }
+
+  return n;
+}
+
+void schedule_apply_search(schedule_t *s, VALUE mode, VALUE limit)
+{
+  // :exact, or :beam / :discrepancy with the beam width or the
+  // discrepancy budget as the limit
+  //
+  ID id = rb_to_id(mode);
+  int n = NIL_P(limit) ? 0 : NUM2INT(limit);
+
+  if (id == rb_intern("exact")) {
+    s->search_mode = SEARCH_EXACT;
+  } else if (id == rb_intern("beam")) {
+    if (n < 1) {
+      rb_raise(rb_eRangeError, "beam width must be at least 1");
+    }
+    s->search_mode = SEARCH_BEAM;
+  } else if (id == rb_intern("discrepancy")) {
+    if (n < 0) {
+      rb_raise(rb_eRangeError, "discrepancy limit must not be negative");
     }
+    s->search_mode = SEARCH_DISCREPANCY;
+  } else {
+    rb_raise(rb_eArgError, "unknown search mode");
+  }
 
-    index = sched->num_constraints;
+  s->search_limit = n;
+}
 
-    // add one new constraints structure to the schedule
-    // for this new set of constraints
-    //
-    sched->num_constraints += 1;
-    sched->constraints =
-      realloc(sched->constraints, sched->num_constraints * sizeof(sched->constraints));
-    sched->constraints[index] = calloc(1, sizeof(context_t));
+VALUE solution_hash(const result_t *r, VALUE returned_weights_hash)
+{
+  VALUE hash = rb_hash_new();
 
-    // allocate the fields inside the new constraints structure
-    //
-    sched->constraints[index]->values = calloc(RARRAY_LEN(constraint_ids), sizeof(uint));
-    sched->constraints[index]->num_values = (uint)RARRAY_LEN(constraint_ids);
+  // build a hash containing the solution sets
+  //
+  for (int i = 0; i < r->count; i++) {
+    node_t *nodes = r->nodes + i * r->num_slots;
+    VALUE arr = rb_ary_new();
+
+    for (int j = 0; j < r->num_slots; j++) {
+      rb_ary_push(arr, INT2NUM(nodes[j].person_id));
+    }
 
-    uint num_attribs = sched->constraints[index]->num_values;
-    int *attribs = sched->constraints[index]->values;
+    rb_hash_aset(hash, INT2NUM(i), arr);
 
-    // update the constraints fields with the caller's data
-    //
-    for (uint i = 0; i < num_attribs; i++) {
-      attribs[i] = NUM2INT((RARRAY_PTR(constraint_ids))[i]);
-      if (debug) {
-        printf("Added attribute %d\n", attribs[i]);
-      }
+    if (!NIL_P(returned_weights_hash)) {
+      rb_hash_aset(returned_weights_hash, INT2NUM(i), rb_float_new(r->total_weights[i]));
     }
+  }
 
-    return Qtrue;
+  return hash;
+}
+
+VALUE solution_packed(const result_t *r)
+{
+  // the solutions as one binary string: count * num_slots native int32
+  // person ids, solution by solution, followed by count native floats
+  // with the weight of each solution
+  //
+  long ids_size = (long)r->count * r->num_slots * sizeof(int32_t);
+  VALUE packed = rb_str_new(NULL, ids_size + r->count * sizeof(float));
+  int32_t *ids = (int32_t *)RSTRING_PTR(packed);
+  float *weights = (float *)(RSTRING_PTR(packed) + ids_size);
+
+  for (long i = 0; i < (long)r->count * r->num_slots; i++) {
+    ids[i] = r->nodes[i].person_id;
   }
+  memcpy(weights, r->total_weights, r->count * sizeof(float));
 
-  return Qfalse;
+  return packed;
+}
+
+int schedule_compute(int num_solutions, result_t *r)
+{
+  schedule_solve(schedule, num_solutions, r);
+  last_stats = stats;
+
+  // keep this solve's trace for schedule_trace_json, and give the old
+  // ring back to the thread for the next solve
+  //
+  trace_t recorded = trace;
+  trace = last_trace;
+  last_trace = recorded;
+
+  return r->count;
 }
 
 VALUE method_schedule_compute_solution(VALUE self, 
                                        VALUE number_of_solutions_to_find, 
                                        VALUE returned_weights_hash)
 {
-  solution_t *root = NULL;
+  result_t result;
+  VALUE hash = Qnil;
 
-  int people = sched->num_people;
-  int slots = sched->num_slots;
+  int num_solutions = requested_solution_count(number_of_solutions_to_find);
 
-  VALUE hash = Qnil;
+  schedule_compute(num_solutions, &result);
+
+  if (result.count == 0) {
+    printf("%s: no solutions found\n", __FUNCTION__);
+    goto bail;
+  }
+
+  for (int i = 0; i < result.count; i++) {
+    printf("%s: solution set %d: ", __FUNCTION__, i);
+    print_solution(result.nodes + i * result.num_slots, result.num_slots);
+  }
 
-  // nPk = n!/(n-k)!
+  hash = solution_hash(&result, returned_weights_hash);
+
+ bail:
+  result_free(&result);
+  return hash;
+}
+
+VALUE method_schedule_compute_packed(VALUE self,
+                                     VALUE number_of_solutions_to_find)
+{
+  // same search as schedule_compute_solution, without building a Ruby
+  // object per entity or printing every solution
   //
-  int total_possible_solutions = fact(people) / fact(people - slots);
+  result_t result;
+  VALUE packed = Qnil;
+
+  int num_solutions = requested_solution_count(number_of_solutions_to_find);
+
+  if (schedule_compute(num_solutions, &result) > 0) {
+    packed = solution_packed(&result);
+  }
+
+  result_free(&result);
+  return packed;
+}
+
+VALUE method_schedule_set_presolve(VALUE self, VALUE enabled)
+{
+  if (schedule) {
+    schedule->presolve = RTEST(enabled);
+    return Qtrue;
+  }
+
+  return Qfalse;
+}
+
+VALUE method_schedule_set_cache(VALUE self, VALUE max_bytes)
+{
+  long n = requested_cache_bytes(max_bytes);
+
+  if (schedule) {
+    schedule->cache_bytes = n;
+    return Qtrue;
+  }
+
+  return Qfalse;
+}
+
+VALUE method_schedule_set_search(VALUE self, VALUE mode, VALUE limit)
+{
+  if (schedule) {
+    schedule_apply_search(schedule, mode, limit);
+    return Qtrue;
+  }
+
+  return Qfalse;
+}
 
-  // initialize the bb proces
+VALUE method_schedule_stats(VALUE self)
+{
+  // counters from the last call to schedule_compute_solution
   //
-  num_expanded_solutions = 0;
-  num_requested_solutions = FIX2UINT(number_of_solutions_to_find);
-  incumbent_set = calloc(num_requested_solutions, sizeof(solution_t));
-  incumbent_count = 0;
-  create_root(&root);
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("expanded")), INT2NUM(last_stats.expanded));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dominated")), INT2NUM(last_stats.dominated));
+  rb_hash_aset(hash, ID2SYM(rb_intern("duplicates")), INT2NUM(last_stats.duplicates));
+  rb_hash_aset(hash, ID2SYM(rb_intern("classes")), INT2NUM(last_stats.classes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("fixed_slots")), INT2NUM(last_stats.fixed_slots));
+  rb_hash_aset(hash, ID2SYM(rb_intern("cache_lookups")), INT2NUM(last_stats.cache_lookups));
+  rb_hash_aset(hash, ID2SYM(rb_intern("cache_hits")), INT2NUM(last_stats.cache_hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("cache_prunes")), INT2NUM(last_stats.cache_prunes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("cache_stores")), INT2NUM(last_stats.cache_stores));
+  rb_hash_aset(hash, ID2SYM(rb_intern("cache_evictions")), INT2NUM(last_stats.cache_evictions));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dp_states")), INT2NUM(last_stats.dp_states));
+  rb_hash_aset(hash, ID2SYM(rb_intern("assignments")), INT2NUM(last_stats.assignments));
+  rb_hash_aset(hash, ID2SYM(rb_intern("root_bound")), rb_float_new(last_stats.root_bound));
+  rb_hash_aset(hash, ID2SYM(rb_intern("gap")),
+               isnan(last_stats.gap) ? Qnil : rb_float_new(last_stats.gap));
+
+  return hash;
+}
 
-  // run the branching algorithm
+VALUE method_schedule_set_trace(VALUE self, VALUE level, VALUE max_events)
+{
+  // the level applies to every later solve; the ring keeps the last
+  // max_events events of a solve (nil keeps the current size)
   //
-  expand_branch(root, 0);
+  int n = NUM2INT(level);
+  long events = NIL_P(max_events) ? (long)trace_capacity : NUM2LONG(max_events);
 
-  if (debug) {
-    printf("%s: checked %d of %d total solutions\n",
-           __FUNCTION__, num_expanded_solutions, total_possible_solutions);
+  if (n < TRACE_LEVEL_OFF || n > TRACE_LEVEL_ALL) {
+    rb_raise(rb_eRangeError, "trace level must be between %d and %d",
+             TRACE_LEVEL_OFF, TRACE_LEVEL_ALL);
+  }
+  if (events < 1 || events > UINT32_MAX) {
+    rb_raise(rb_eRangeError, "trace must hold at least one event");
   }
 
-  if (incumbent_count == 0) {
-    printf("%s: no solutions found\n", __FUNCTION__);
-    goto bail;
+  trace_level = n;
+  trace_capacity = (uint32_t)events;
+
+  return Qtrue;
+}
+
+VALUE method_schedule_trace_json(VALUE self)
+{
+  // the trace of the last call to schedule_compute_solution in the
+  // Chrome trace event format, or nil if it was not traced
+  //
+  static const char *types[] = {
+    "solve", "candidates", "presolve", "create", "select", "expand",
+    "prune", "incumbent", "compare", "constraint", "free"
+  };
+  static const char *reasons[] = {
+    "none", "begin", "end", "bound", "cache", "leaf", "beam", "pass",
+    "fail", "dominated", "duplicate", "forced", "reduced"
+  };
+  uint64_t kept = 0;
+  uint64_t first = 0;
+  VALUE json = Qnil;
+
+  if (last_trace.level == TRACE_LEVEL_OFF || !last_trace.events) {
+    return Qnil;
   }
 
-  hash = rb_hash_new();
+  kept = last_trace.count < last_trace.capacity ?
+    last_trace.count : last_trace.capacity;
+  first = last_trace.count - kept;
 
-  // build a hash containing the solution sets
+  json = rb_str_buf_new(64 + kept * 160);
+  rb_str_cat_cstr(json, "{\"traceEvents\":[");
+
+  for (uint64_t i = first; i < last_trace.count; i++) {
+    trace_event_t *e = &last_trace.events[i % last_trace.capacity];
+    const char *phase = "i";
+
+    if (e->type == TRACE_SOLVE) {
+      phase = (e->reason == TRACE_REASON_BEGIN) ? "B" : "E";
+    }
+
+    rb_str_catf(json,
+                "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+                "\"pid\":1,\"tid\":1,\"s\":\"t\",\"args\":{"
+                "\"reason\":\"%s\",\"depth\":%d,\"person\":%d,"
+                "\"weight\":%.6g,\"value\":%d}}",
+                (i == first) ? "" : ",", types[e->type], phase,
+                e->time / 1000.0, reasons[e->reason], (int)e->depth,
+                (int)e->person_id, (double)e->weight, (int)e->value);
+  }
+
+  rb_str_catf(json, "],\"displayTimeUnit\":\"ns\","
+              "\"otherData\":{\"level\":%d,\"dropped\":%llu}}",
+              last_trace.level, (unsigned long long)first);
+
+  return json;
+}
+
+typedef struct _batch_call_t batch_call_t;
+
+struct _batch_call_t {
+  VALUE instances;
+  VALUE returned_weights_array;
+  batch_t batch;
+};
+
+VALUE batch_option(VALUE instance, const char *name)
+{
+  return rb_hash_aref(instance, ID2SYM(rb_intern(name)));
+}
+
+int batch_completed(const batch_t *b)
+{
+  for (int i = 0; i < b->count; i++) {
+    if (!b->completed[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+VALUE batch_call(VALUE arg)
+{
+  batch_call_t *call = (batch_call_t *)arg;
+  batch_t *b = &call->batch;
+  VALUE results = rb_ary_new();
+
+  // build every schedule while we still hold the GVL, then solve them
+  // all without it
   //
-  int i = 0;
-  while(i < incumbent_count && i < num_requested_solutions) {
+  for (int i = 0; i < b->count; i++) {
+    VALUE instance = rb_ary_entry(call->instances, i);
+    VALUE weights = Qnil;
+    VALUE attributes = Qnil;
+    VALUE constraints = Qnil;
+    VALUE option = Qnil;
+    int ok = 1;
+
+    Check_Type(instance, T_HASH);
+
+    option = batch_option(instance, "slots");
+    if (NIL_P(option) || NUM2INT(option) < 1) {
+      rb_raise(rb_eArgError, "instance %d: slots must be at least 1", i);
+    }
 
-    printf("%s: solution set %d: ", __FUNCTION__, i);
-    print_solution(incumbent_set[i].node_list, slots);
+    b->schedules[i] = schedule_new(NUM2INT(option));
+    b->num_solutions[i] = 1;
 
-    VALUE arr = rb_ary_new();
+    option = batch_option(instance, "solutions");
+    if (!NIL_P(option)) {
+      b->num_solutions[i] = requested_solution_count(option);
+    }
 
-    for (int j = 0; j < slots; j++) {
-      rb_ary_push(arr, INT2NUM(incumbent_set[i].node_list[j].person_id));
+    option = batch_option(instance, "presolve");
+    if (!NIL_P(option)) {
+      b->schedules[i]->presolve = RTEST(option);
     }
 
-    rb_hash_aset(hash, INT2NUM(i), arr);
+    option = batch_option(instance, "cache");
+    if (!NIL_P(option)) {
+      b->schedules[i]->cache_bytes = requested_cache_bytes(option);
+    }
 
-    if (!NIL_P(returned_weights_hash)) {
-      rb_hash_aset(returned_weights_hash, INT2NUM(i), rb_float_new(incumbent_set[i].total_weight));
+    option = batch_option(instance, "search");
+    if (!NIL_P(option)) {
+      Check_Type(option, T_ARRAY);
+      schedule_apply_search(b->schedules[i], rb_ary_entry(option, 0), rb_ary_entry(option, 1));
     }
 
-    i++;
+    // weights are either one packed String for the whole instance or
+    // one row per entity, each an Array (dense) or a Hash (sparse)
+    //
+    weights = batch_option(instance, "weights");
+    attributes = batch_option(instance, "attributes");
+
+    if (TYPE(weights) == T_STRING) {
+      ok = schedule_add_packed_weights(b->schedules[i], weights, attributes);
+    } else {
+      Check_Type(weights, T_ARRAY);
+      if (!NIL_P(attributes)) {
+        Check_Type(attributes, T_ARRAY);
+        ok = (RARRAY_LEN(attributes) == RARRAY_LEN(weights));
+      }
+
+      for (long j = 0; ok && j < RARRAY_LEN(weights); j++) {
+        VALUE row = RARRAY_PTR(weights)[j];
+        VALUE attribute_ids = NIL_P(attributes) ? rb_ary_new() : RARRAY_PTR(attributes)[j];
+
+        if (TYPE(row) == T_HASH) {
+          ok = schedule_add_sparse_weight(b->schedules[i], row, attribute_ids);
+        } else {
+          ok = schedule_add_weight(b->schedules[i], row, attribute_ids);
+        }
+      }
+    }
+
+    if (!ok) {
+      rb_raise(rb_eArgError, "instance %d: malformed weights", i);
+    }
+
+    constraints = batch_option(instance, "constraints");
+    if (!NIL_P(constraints)) {
+      Check_Type(constraints, T_ARRAY);
+      for (long j = 0; j < RARRAY_LEN(constraints); j++) {
+        if (!schedule_add_constraint(b->schedules[i], RARRAY_PTR(constraints)[j])) {
+          rb_raise(rb_eArgError, "instance %d: empty constraint", i);
+        }
+      }
+    }
   }
 
- bail:
-  free_branch(root);
-  safe_free(root);
-  safe_free(incumbent_set);
-  return hash;
+  // an interrupt cancels the batch.  rb_thread_check_ints raises when it
+  // carries an exception, and the ensure frees the batch; otherwise (a
+  // trap handler, Thread#wakeup) the instances left unsolved are picked
+  // up again.
+  //
+  while (!batch_completed(b)) {
+    b->cancelled = 0;
+    b->next = 0;
+    rb_thread_call_without_gvl(batch_run, b, batch_interrupt, b);
+    rb_thread_check_ints();
+  }
+
+  for (int i = 0; i < b->count; i++) {
+    VALUE weights_hash = Qnil;
+
+    if (!NIL_P(call->returned_weights_array)) {
+      weights_hash = rb_hash_new();
+      rb_ary_push(call->returned_weights_array, weights_hash);
+    }
+
+    if (b->results[i].count == 0) {
+      rb_ary_push(results, Qnil);
+    } else {
+      rb_ary_push(results, solution_hash(&b->results[i], weights_hash));
+    }
+  }
+
+  return results;
+}
+
+VALUE batch_cleanup(VALUE arg)
+{
+  batch_t *b = &((batch_call_t *)arg)->batch;
+
+  for (int i = 0; i < b->count; i++) {
+    if (b->schedules[i]) {
+      schedule_destroy(b->schedules[i]);
+    }
+    result_free(&b->results[i]);
+  }
+  safe_free(b->schedules);
+  safe_free(b->num_solutions);
+  safe_free(b->results);
+  safe_free(b->completed);
+
+  return Qnil;
+}
+
+VALUE method_schedule_compute_batch(VALUE self,
+                                    VALUE instances,
+                                    VALUE returned_weights_array)
+{
+  // solves many independent schedules in one call, spread over a
+  // native thread per core.  each instance is a Hash:
+  //
+  //   { :slots => 4,
+  //     :weights => [[...], {slot => weight}, ...] or a packed String,
+  //     :attributes => [[...], ...], :constraints => [[...], ...],
+  //     :solutions => 1, :presolve => true, :cache => 0,
+  //     :search => [:beam, 8] }
+  //
+  // returns an Array with the solution hash of every instance (nil when
+  // nothing was found), in the same order as the instances.
+  //
+  batch_call_t call;
+
+  Check_Type(instances, T_ARRAY);
+  if (!NIL_P(returned_weights_array)) {
+    Check_Type(returned_weights_array, T_ARRAY);
+  }
+
+  memset(&call, 0, sizeof(batch_call_t));
+  call.instances = instances;
+  call.returned_weights_array = returned_weights_array;
+  call.batch.count = (int)RARRAY_LEN(instances);
+  call.batch.schedules = calloc(call.batch.count, sizeof(schedule_t *));
+  call.batch.num_solutions = calloc(call.batch.count, sizeof(int));
+  call.batch.results = calloc(call.batch.count, sizeof(result_t));
+  call.batch.completed = calloc(call.batch.count, sizeof(char));
+
+  return rb_ensure(batch_call, (VALUE)&call, batch_cleanup, (VALUE)&call);
 }
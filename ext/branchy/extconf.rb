@@ -3,5 +3,8 @@ require 'mkmf'
 
 $CFLAGS << " -std=c99"
 
+# the batch solver runs on a native thread pool
+have_library('pthread')
+
 create_makefile('branchy/branchy')
 
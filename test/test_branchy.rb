@@ -1,5 +1,7 @@
 require 'helper'
 require 'matrix'
+require 'json'
+require 'etc'
 
 class TestBranchy < Test::Unit::TestCase
   context "create new schedules" do
@@ -43,6 +45,12 @@ class TestBranchy < Test::Unit::TestCase
         @s.schedule_free()
       end
 
+      should "set a sparse weight for a bigger schedule" do
+        @s.schedule_create(3)
+        assert_equal true, @s.schedule_set_sparse_weight({2 => 3.0, 0 => 1.0}, [0, 1, 2])
+        @s.schedule_free()
+      end
+
       should "set a single constraint for a simple schedule" do
         @s.schedule_create(1)
         assert_equal true, @s.schedule_set_constraints([0])
@@ -81,6 +89,39 @@ class TestBranchy < Test::Unit::TestCase
         @s.schedule_free()
       end
 
+      should "not set a sparse weight with an out of range slot" do
+        @s.schedule_create(2)
+        assert_equal false, @s.schedule_set_sparse_weight({2 => 1.0}, [0])
+        assert_equal false, @s.schedule_set_sparse_weight({-1 => 1.0}, [0])
+        @s.schedule_free()
+      end
+
+      should "not set a sparse weight with a non-integer slot" do
+        @s.schedule_create(2)
+        assert_raise TypeError do
+          @s.schedule_set_sparse_weight({0 => 1.0, 0.0 => 2.0, 1.5 => 0.5}, [0])
+        end
+        @s.schedule_free()
+      end
+
+      should "not set a sparse weight that gives a slot twice" do
+        weights = {0 => 1.0, 1 => 0.5}
+        def weights.to_a
+          [[0, 1.0], [1, 0.5], [0, 2.0]]
+        end
+
+        @s.schedule_create(2)
+        assert_equal false, @s.schedule_set_sparse_weight(weights, [0])
+        assert_equal nil, @s.schedule_compute_solution(1, nil)
+        @s.schedule_free()
+      end
+
+      should "not set a sparse weight with an empty weight set" do
+        @s.schedule_create(2)
+        assert_equal false, @s.schedule_set_sparse_weight({}, [0])
+        @s.schedule_free()
+      end
+
       should "not set a single constraint with an empty constraint set" do
         @s.schedule_create(1)
         assert_equal false, @s.schedule_set_constraints([])
@@ -168,8 +209,39 @@ class TestBranchy < Test::Unit::TestCase
         end
 
         @s.schedule_print()
-        assert_equal({0=>[0, 2, 1, 3]}, @s.schedule_compute_solution(1, nil))
+        assert_equal({0=>[0, 1, 2, 3]}, @s.schedule_compute_solution(1, nil))
+        @s.schedule_free()
+      end
+
+      should "match each constraint set with a different entity" do
+        @s.schedule_create(2)
+        @s.schedule_set_weight([1.0, 0.95], [0])
+        @s.schedule_set_weight([0.5, 0.9], [1])
+        @s.schedule_set_weight([0.2, 0.3], [0])
+        @s.schedule_set_constraints([0])
+        @s.schedule_set_constraints([0])
+        assert_equal({0=>[2, 0]}, @s.schedule_compute_solution(1, nil))
+        @s.schedule_free()
+
+        @s.schedule_create(2)
+        @s.schedule_set_weight([1.0, 0.95], [0])
+        @s.schedule_set_weight([0.5, 0.9], [1])
+        @s.schedule_set_weight([0.2, 0.3], [1])
+        @s.schedule_set_constraints([0])
+        @s.schedule_set_constraints([0])
+        assert_equal nil, @s.schedule_compute_solution(1, nil)
         @s.schedule_free()
+
+        [[[0], [0, 1]], [[0, 1], [0]]].each do |constraints|
+          @s.schedule_create(2)
+          @s.schedule_set_weight([1.0, 0.1], [0, 1])
+          @s.schedule_set_weight([0.1, 1.0], [0])
+          constraints.each { |c| @s.schedule_set_constraints(c) }
+          weights_hash = {}
+          assert_equal({0=>[0, 1]}, @s.schedule_compute_solution(1, weights_hash))
+          assert_equal({0=>2.0}, weights_hash)
+          @s.schedule_free()
+        end
       end
 
       should "compute a correct solution for a simple set" do
@@ -237,7 +309,7 @@ class TestBranchy < Test::Unit::TestCase
         end
 
         @s.schedule_print()
-        assert_equal({0=>[2, 0, 1, 3]}, @s.schedule_compute_solution(1, nil))
+        assert_equal({0=>[2, 1, 3, 0]}, @s.schedule_compute_solution(1, nil))
         @s.schedule_free()
       end
 
@@ -266,7 +338,7 @@ class TestBranchy < Test::Unit::TestCase
         end
 
         @s.schedule_print()
-        assert_equal({0=>[2, 3, 4, 9]}, @s.schedule_compute_solution(1, nil))
+        assert_equal({0=>[2, 1, 7, 9]}, @s.schedule_compute_solution(1, nil))
         @s.schedule_free()
       end
 
@@ -318,11 +390,180 @@ class TestBranchy < Test::Unit::TestCase
 
         @s.schedule_print()
         weights_hash = {}
-        assert_equal({0=>[2, 1]}, @s.schedule_compute_solution(1, weights_hash))
+        assert_equal({0=>[0, 1]}, @s.schedule_compute_solution(1, weights_hash))
         assert_equal({0=>2.0}, weights_hash)
         @s.schedule_free()
       end
 
+      should "compute a correct solution for a sparse set" do
+        # each entity is only eligible for the slots it lists
+        #
+        @s.schedule_create(4)
+        @s.schedule_set_sparse_weight({0 => 1.0}, [0])
+        @s.schedule_set_sparse_weight({1 => 1.0, 3 => 0.5}, [0])
+        @s.schedule_set_sparse_weight({2 => 1.0}, [0])
+        @s.schedule_set_sparse_weight({3 => 1.0, 1 => 0.5}, [0])
+        @s.schedule_set_weight([0.1, 0.1, 0.1, 0.1], [0])
+
+        @s.schedule_print()
+        assert_equal({0=>[0, 1, 2, 3]}, @s.schedule_compute_solution(1, nil))
+        @s.schedule_free()
+      end
+
+      should "compute the same solution for sparse and dense weights" do
+        m = Matrix[
+            [ 1.201, 1.121, 0.222, 1.122 ],
+            [ 1.11 , 1.2  , 1.111, 0.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.222, 1.222, 1.222, 1.222 ]
+        ]
+
+        @s.schedule_create(m.column_size)
+
+        for i in 0..(m.row_size - 1) do
+          row = {}
+          m.row(i).each_with_index { |w, j| row[j] = w }
+          @s.schedule_set_sparse_weight(row, [0])
+        end
+
+        for i in 0..(m.column_size - 1) do
+          @s.schedule_set_constraints([0])
+        end
+
+        assert_equal({0=>[2, 1, 3, 0]}, @s.schedule_compute_solution(1, nil))
+        @s.schedule_free()
+      end
+
+      should "lock sparse entities below the root with their own slot weight" do
+        [nil, 1 << 20].each do |cache|
+          @s.schedule_create(3)
+          @s.schedule_set_sparse_weight({0 => 1.0}, [0])
+          @s.schedule_set_sparse_weight({1 => 1.0, 2 => 1.0}, [0])
+          @s.schedule_set_sparse_weight({1 => 0.5, 2 => 0.6}, [0])
+          @s.schedule_set_constraints([0])
+          @s.schedule_set_cache(cache) if cache
+
+          weights_hash = {}
+          assert_equal({0=>[0, 1, 2]}, @s.schedule_compute_solution(1, weights_hash))
+          assert_in_delta 2.6, weights_hash[0], 1e-6
+          @s.schedule_free()
+        end
+      end
+
+      should "drop dominated entities before branching" do
+        @s.schedule_create(2)
+        @s.schedule_set_sparse_weight({0 => 2.0}, [0])
+        @s.schedule_set_weight([1.0, 1.0], [0])
+        @s.schedule_set_weight([1.0, 1.0], [0])
+        @s.schedule_set_weight([1.0, 1.0], [0])
+        @s.schedule_set_weight([0.9, 0.5], [1])
+        @s.schedule_set_weight([0.3, 0.2], [1])
+        @s.schedule_set_weight([0.3, 0.1], [1])
+        @s.schedule_set_weight([0.1, 0.1], [1])
+
+        weights_hash = {}
+        assert_equal({0=>[0, 1], 1=>[0, 2]}, @s.schedule_compute_solution(2, weights_hash))
+        assert_equal({0=>3.0, 1=>3.0}, weights_hash)
+
+        stats = @s.schedule_stats()
+        assert_equal 3, stats[:dominated]
+        assert_equal 1, stats[:classes]
+        @s.schedule_free()
+      end
+
+      should "map forced slots back to the original schedule" do
+        @s.schedule_create(3)
+        @s.schedule_set_sparse_weight({0 => 1.0}, [0])
+        @s.schedule_set_sparse_weight({1 => 1.0, 2 => 0.5}, [0])
+        @s.schedule_set_sparse_weight({1 => 0.5, 2 => 1.0}, [0])
+        @s.schedule_set_sparse_weight({1 => 0.2, 2 => 0.2}, [0])
+
+        assert_equal({0=>[0, 1, 2]}, @s.schedule_compute_solution(1, nil))
+        assert_equal 1, @s.schedule_stats()[:fixed_slots]
+
+        @s.schedule_set_presolve(false)
+        assert_equal({0=>[0, 1, 2]}, @s.schedule_compute_solution(1, nil))
+        assert_equal 0, @s.schedule_stats()[:fixed_slots]
+        @s.schedule_free()
+      end
+
+      should "compute a correct solution for a larger set with the subset cache" do
+        m = Matrix[
+            [ 1.201, 1.121, 0.222, 1.122 ],
+            [ 1.11 , 1.2  , 1.111, 0.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 0.221, 1.121, 1.202, 1.121 ],
+            [ 0.112, 0.022, 0.111, 1.1   ],
+            [ 1.121, 1.212, 1.22,  1.212 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.222, 1.222, 1.222, 1.222 ]
+        ]
+
+        @s.schedule_create(m.column_size)
+
+        for i in 0..(m.row_size - 1) do
+          @s.schedule_set_weight(m.row(i).to_a, [0])
+        end
+
+        for i in 0..(m.column_size - 1) do
+          @s.schedule_set_constraints([0])
+        end
+
+        @s.schedule_set_cache(1 << 20)
+        assert_equal({0=>[2, 1, 7, 9]}, @s.schedule_compute_solution(1, nil))
+        assert @s.schedule_stats()[:dp_states] > 0
+        @s.schedule_free()
+      end
+
+      should "compute multiple solutions for a larger set with a small cache" do
+        m = Matrix[
+            [ 1.201, 1.121, 0.222, 1.122 ],
+            [ 1.11 , 1.2  , 1.111, 0.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 0.221, 1.121, 1.202, 1.121 ],
+            [ 0.112, 0.022, 0.111, 1.1   ],
+            [ 1.121, 1.212, 1.22,  1.212 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.222, 1.222, 1.222, 1.222 ]
+        ]
+
+        @s.schedule_create(m.column_size)
+
+        for i in 0..(m.row_size - 1) do
+          @s.schedule_set_weight(m.row(i).to_a, [0])
+        end
+
+        for i in 0..(m.column_size - 1) do
+          @s.schedule_set_constraints([0])
+        end
+
+        # too small for the subset table, so the hash table is used
+        #
+        @s.schedule_set_cache(1024)
+        assert_equal({0=>[2, 1, 7, 9], 1=>[3, 1, 7, 9], 2=>[4, 1, 7, 9]}, @s.schedule_compute_solution(3, nil))
+
+        stats = @s.schedule_stats()
+        assert_equal 0, stats[:dp_states]
+        assert stats[:cache_stores] > 0
+        assert stats[:cache_lookups] >= stats[:cache_hits]
+        @s.schedule_free()
+      end
+
+      should "compute a correct solution on both sides of the small kernel limit" do
+        [16, 17].each do |n|
+          @s.schedule_create(n)
+          n.times { |i| @s.schedule_set_weight((0...n).map { |j| i == j ? 1.0 : 0.5 }, [0]) }
+          @s.schedule_set_constraints([0])
+
+          assert_equal({0=>(0...n).to_a}, @s.schedule_compute_solution(1, nil))
+          @s.schedule_free()
+        end
+      end
+
       should "compute multiple solution for a larger set" do
         m = Matrix[
             [ 1.201, 1.121, 0.222, 1.122 ],
@@ -349,10 +590,182 @@ class TestBranchy < Test::Unit::TestCase
 
         @s.schedule_print()
         weights_hash = {}
-        assert_equal({0=>[2, 3, 4, 9], 1=>[2, 4, 3, 9], 2=>[2, 8, 3, 9]}, @s.schedule_compute_solution(3, weights_hash))
-        assert_equal({0=>4.8580002784729, 1=>4.8580002784729, 2=>4.8580002784729}, weights_hash)
+        assert_equal({0=>[2, 1, 7, 9], 1=>[3, 1, 7, 9], 2=>[4, 1, 7, 9]}, @s.schedule_compute_solution(3, weights_hash))
+        assert_equal({0=>4.854000091552734, 1=>4.854000091552734, 2=>4.854000091552734}, weights_hash)
+        @s.schedule_free()
+      end
+
+      should "rank the best assignments for a set with no constraints" do
+        m = Matrix[
+            [ 1.201, 1.121, 0.222, 1.122 ],
+            [ 1.11 , 1.2  , 1.111, 0.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 0.221, 1.121, 1.202, 1.121 ],
+            [ 0.112, 0.022, 0.111, 1.1   ],
+            [ 1.222, 1.222, 1.222, 1.222 ]
+        ]
+
+        @s.schedule_create(m.column_size)
+
+        for i in 0..(m.row_size - 1) do
+          @s.schedule_set_weight(m.row(i).to_a, [0])
+        end
+
+        weights_hash = {}
+        assert_equal({0=>[2, 1, 3, 5], 1=>[0, 1, 3, 5], 2=>[2, 5, 3, 0]}, @s.schedule_compute_solution(3, weights_hash))
+        assert_equal({0=>4.836000442504883, 1=>4.825000286102295, 2=>4.758000373840332}, weights_hash)
+        assert_operator @s.schedule_stats()[:assignments], :>, 0
         @s.schedule_free()
       end
+
+      should "compute packed solutions matching the solution hash" do
+        m = Matrix[
+            [ 1.201, 1.121, 0.222, 1.122 ],
+            [ 1.11 , 1.2  , 1.111, 0.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 0.221, 1.121, 1.202, 1.121 ],
+            [ 0.112, 0.022, 0.111, 1.1   ],
+            [ 1.222, 1.222, 1.222, 1.222 ]
+        ]
+
+        @s.schedule_create(m.column_size)
+
+        for i in 0..(m.row_size - 1) do
+          @s.schedule_set_weight(m.row(i).to_a, [0])
+        end
+
+        packed = @s.schedule_compute_packed(3)
+        ids = packed.unpack("l12")
+        weights = packed.byteslice(48, 12).unpack("f3")
+
+        assert_equal 60, packed.bytesize
+        assert_equal [2, 1, 3, 5, 0, 1, 3, 5, 2, 5, 3, 0], ids
+        assert_equal [4.836000442504883, 4.825000286102295, 4.758000373840332], weights
+        @s.schedule_free()
+      end
+
+      should "compute a bounded solution with the heuristic search modes" do
+        m = Matrix[
+            [ 1.201, 1.121, 0.222, 1.122 ],
+            [ 1.11 , 1.2  , 1.111, 0.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 0.221, 1.121, 1.202, 1.121 ],
+            [ 0.112, 0.022, 0.111, 1.1   ],
+            [ 1.121, 1.212, 1.22,  1.212 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.222, 1.222, 1.222, 1.222 ]
+        ]
+
+        [[:beam, 2], [:discrepancy, 1]].each do |mode, limit|
+          @s.schedule_create(m.column_size)
+
+          for i in 0..(m.row_size - 1) do
+            @s.schedule_set_weight(m.row(i).to_a, [0])
+          end
+
+          @s.schedule_set_search(mode, limit)
+          weights_hash = {}
+          @s.schedule_compute_solution(1, weights_hash)
+          stats = @s.schedule_stats()
+
+          assert_equal({0=>4.8480000495910645}, weights_hash)
+          assert_in_delta stats[:root_bound] - weights_hash[0], stats[:gap], 1e-6
+          @s.schedule_free()
+        end
+      end
+
+      should "record a trace of the search when tracing is enabled" do
+        m = Matrix[
+            [ 1.201, 1.121, 0.222, 1.122 ],
+            [ 1.11 , 1.2  , 1.111, 0.122 ],
+            [ 1.212, 1.122, 0.222, 1.122 ],
+            [ 1.222, 1.222, 1.222, 1.222 ]
+        ]
+
+        @s.schedule_create(m.column_size)
+
+        for i in 0..(m.row_size - 1) do
+          @s.schedule_set_weight(m.row(i).to_a, [0])
+        end
+        @s.schedule_set_constraints([0])
+
+        @s.schedule_compute_solution(1, nil)
+        assert_equal nil, @s.schedule_trace_json()
+
+        weights_hash = {}
+        @s.schedule_set_trace(2, nil)
+        @s.schedule_compute_solution(1, weights_hash)
+        @s.schedule_set_trace(0, nil)
+
+        events = JSON.parse(@s.schedule_trace_json())["traceEvents"]
+        names = events.map { |e| e["name"] }
+
+        assert_equal ["B", "E"], events.select { |e| e["name"] == "solve" }.map { |e| e["ph"] }
+        assert_equal [], names - ["solve", "candidates", "create", "select", "expand", "prune", "incumbent"]
+        assert_equal [], ["create", "select", "expand", "prune"] - names
+        assert events.any? { |e| e["name"] == "prune" && e["args"]["reason"] == "bound" }
+        assert_in_delta weights_hash[0], events.select { |e| e["name"] == "incumbent" }.last["args"]["weight"], 1e-5
+        @s.schedule_free()
+      end
+
+      should "compute a batch with the same results as one schedule at a time" do
+        rows = (0...12).map { |i| (0...6).map { |j| ((i * 7 + j * 13) % 10) / 10.0 } }
+        instances = [
+          { :slots => 6, :weights => rows, :solutions => 3,
+            :attributes => rows.map { [0] }, :constraints => [[0]] },
+          { :slots => 4, :weights => [{0 => 1.0}, {1 => 1.0, 3 => 0.5}, {2 => 1.0},
+                                      {3 => 1.0, 1 => 0.5}, [0.1, 0.1, 0.1, 0.1]] },
+          { :slots => 6, :weights => rows.flatten.pack('f*'), :solutions => 2 },
+          { :slots => 5, :weights => rows.first(3).map { |r| r.first(5) } }
+        ]
+
+        batch_weights = []
+        results = @s.schedule_compute_batch(instances * 4, batch_weights)
+
+        expected = instances.map do |instance|
+          @s.schedule_create(instance[:slots])
+          if instance[:weights].is_a?(String)
+            instance[:weights].unpack('f*').each_slice(instance[:slots]) { |r| @s.schedule_set_weight(r, [0]) }
+          else
+            instance[:weights].each do |r|
+              r.is_a?(Hash) ? @s.schedule_set_sparse_weight(r, [0]) : @s.schedule_set_weight(r, [0])
+            end
+          end
+          (instance[:constraints] || []).each { |c| @s.schedule_set_constraints(c) }
+          weights_hash = {}
+          solution = @s.schedule_compute_solution(instance[:solutions] || 1, weights_hash)
+          @s.schedule_free()
+          [solution, solution ? weights_hash : {}]
+        end
+
+        assert_equal expected * 4, results.zip(batch_weights)
+        assert_equal nil, results[3]
+      end
+
+      should "finish a batch interrupted by a trapped signal" do
+        # every entity fails the constraint, so the slow instances search
+        # their whole tree; there are two of them per thread
+        #
+        rows = (0...9).map { |i| (0...9).map { |j| ((i * 37 + j * 91 + i * j * 17) % 101) / 101.0 } }
+        slow = { :slots => 9, :weights => rows, :constraints => [[0]], :presolve => false }
+        quick = { :slots => 4, :weights => rows.first(6).map { |r| r.first(4) } }
+        instances = [slow] * (2 * Etc.nprocessors) + [quick] * 2
+
+        expected = @s.schedule_compute_batch([slow, quick], nil)
+        previous = trap("USR1") { }
+        begin
+          signal = Thread.new { sleep 0.03; Process.kill("USR1", Process.pid) }
+          results = @s.schedule_compute_batch(instances, nil)
+          signal.join
+        ensure
+          trap("USR1", previous)
+        end
+
+        assert_equal [expected[0]] * (2 * Etc.nprocessors) + [expected[1]] * 2, results
+        assert_not_nil results.last
+      end
     end
 
     context "with invalid params" do
@@ -396,6 +809,38 @@ class TestBranchy < Test::Unit::TestCase
         @s.schedule_free()
       end
 
+      should "return an argument error for a malformed batch instance" do
+        assert_raise ArgumentError do
+          @s.schedule_compute_batch([{ :slots => 2, :weights => [[1.0, 0.5]] },
+                                     { :slots => 2, :weights => [[1.0]] }], nil)
+        end
+      end
+
+      should "return a range error when setting an empty beam" do
+        @s.schedule_create(1)
+        assert_raise RangeError do
+          @s.schedule_set_search(:beam, 0)
+        end
+        @s.schedule_free()
+      end
+
+      should "return a range error when setting an unknown trace level" do
+        assert_raise RangeError do
+          @s.schedule_set_trace(4, nil)
+        end
+        assert_raise RangeError do
+          @s.schedule_set_trace(1, 0)
+        end
+      end
+
+      should "return a range error when setting a negative cache size" do
+        @s.schedule_create(1)
+        assert_raise RangeError do
+          @s.schedule_set_cache(-1)
+        end
+        @s.schedule_free()
+      end
+
       should "return a type error when requesting an invalid solution count" do
         m = Matrix[
             [ 1, 0, 0, 0 ],